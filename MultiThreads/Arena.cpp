@@ -0,0 +1,51 @@
+#include "Arena.h"
+
+#include <cstdint>
+
+// Allocations larger than a quarter block get a block of their own, so a
+// bump block never wastes more than a quarter of its space.
+static const size_t BLOCK_SIZE = 64 * 1024;
+
+Arena::~Arena() {
+    for (Finalizer* f = finalizers; f != nullptr; f = f->next) {
+        f->destroy(f->object);
+    }
+    while (blocks != nullptr) {
+        Block* next = blocks->next;
+        ::operator delete(blocks);
+        blocks = next;
+    }
+}
+
+void* Arena::allocateBlock(size_t size) {
+    auto* block = static_cast<Block*>(::operator new(sizeof(Block) + size + alignof(std::max_align_t)));
+    block->next = blocks;
+    blocks = block;
+    block_count++;
+    return block + 1;
+}
+
+void* Arena::allocate(size_t size, size_t align) {
+    auto aligned = (reinterpret_cast<uintptr_t>(cursor) + align - 1) & ~(uintptr_t(align) - 1);
+    if (cursor != nullptr && aligned + size <= reinterpret_cast<uintptr_t>(limit)) {
+        cursor = reinterpret_cast<char*>(aligned + size);
+        return reinterpret_cast<void*>(aligned);
+    }
+
+    if (size + align > BLOCK_SIZE / 4) {
+        auto start = reinterpret_cast<uintptr_t>(allocateBlock(size + align));
+        return reinterpret_cast<void*>((start + align - 1) & ~(uintptr_t(align) - 1));
+    }
+
+    cursor = static_cast<char*>(allocateBlock(BLOCK_SIZE));
+    limit = cursor + BLOCK_SIZE;
+    return allocate(size, align);
+}
+
+void Arena::addFinalizer(void (*destroy)(void*), void* object) {
+    auto* finalizer = static_cast<Finalizer*>(allocate(sizeof(Finalizer), alignof(Finalizer)));
+    finalizer->destroy = destroy;
+    finalizer->object = object;
+    finalizer->next = finalizers;
+    finalizers = finalizer;
+}
@@ -0,0 +1,59 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Bump allocator whose memory is only released all at once, by its destructor.
+// Objects made with create are destroyed then as well, in reverse order.
+// Not thread safe: every worker of a job has its own arena.
+class Arena {
+public:
+    Arena() = default;
+    ~Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t align = alignof(std::max_align_t));
+
+    template <class T, class... Args>
+    T* create(Args&&... args) {
+        void* memory = allocate(sizeof(T), alignof(T));
+        T* object = new (memory) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value) {
+            addFinalizer(&destroy<T>, object);
+        }
+        return object;
+    }
+
+    // number of blocks taken from the heap so far
+    size_t blockCount() const { return block_count; }
+
+private:
+    struct Block {
+        Block* next;
+    };
+
+    struct Finalizer {
+        void (*destroy)(void*);
+        void* object;
+        Finalizer* next;
+    };
+
+    template <class T>
+    static void destroy(void* object) {
+        static_cast<T*>(object)->~T();
+    }
+
+    void addFinalizer(void (*destroy)(void*), void* object);
+    void* allocateBlock(size_t size);
+
+    char* cursor = nullptr;
+    char* limit = nullptr;
+    Block* blocks = nullptr;
+    Finalizer* finalizers = nullptr;
+    size_t block_count = 0;
+};
+
+#endif // ARENA_H
@@ -1,13 +1,52 @@
 #include "Barrier.h"
 
-Barrier::Barrier(int numThreads)
-        : count(0)
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Spins on the sense flag before a thread goes to sleep, about as long as a
+// futex round trip takes.
+static const int SPIN_LIMIT = 1024;
+
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// std::atomic<int> has the layout of an int, so its address can serve as the
+// futex word.
+static void futexWait(std::atomic<int>* word, int expected) {
+    syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+static void futexWakeAll(std::atomic<int>* word) {
+    syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+Barrier::Barrier(int numThreads, barrier_mode_t mode)
+        : mode(mode)
+        , count(0)
         , generation(0)
+        , remaining(numThreads)
+        , sense(0)
+        , sleepers(0)
         , numThreads(numThreads)
 { }
 
 
 void Barrier::barrier() {
+    if (mode == SPINNING_BARRIER) {
+        spinningBarrier();
+    } else {
+        blockingBarrier();
+    }
+}
+
+void Barrier::blockingBarrier() {
     std::unique_lock<std::mutex> lock(mutex);
     int gen = generation;
 
@@ -19,3 +58,34 @@ void Barrier::barrier() {
         cv.notify_all();
     }
 }
+
+// The sense cannot flip before this thread arrives, so the value read on the
+// way in is this round's. The last thread resets the count before flipping
+// the sense, so the next round may start as soon as anyone sees the flip.
+void Barrier::spinningBarrier() {
+    int local_sense = sense.load();
+
+    if (remaining.fetch_sub(1) == 1) {
+        remaining.store(numThreads);
+        sense.store(!local_sense);
+        // Sleepers register before checking the sense, so either they see the
+        // flip or we see them.
+        if (sleepers.load() > 0) {
+            futexWakeAll(&sense);
+        }
+        return;
+    }
+
+    for (int i = 0; i < SPIN_LIMIT; ++i) {
+        if (sense.load(std::memory_order_acquire) != local_sense) {
+            return;
+        }
+        cpuRelax();
+    }
+
+    sleepers.fetch_add(1);
+    while (sense.load() == local_sense) {
+        futexWait(&sense, local_sense);
+    }
+    sleepers.fetch_sub(1);
+}
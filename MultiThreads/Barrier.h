@@ -1,19 +1,37 @@
 #ifndef BARRIER_H
 #define BARRIER_H
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
 
+// BLOCKING_BARRIER sleeps on a condition variable. SPINNING_BARRIER spins on a
+// sense-reversing flag for a short while before sleeping on a futex, which
+// is faster when every thread has a core of its own.
+enum barrier_mode_t {BLOCKING_BARRIER=0, SPINNING_BARRIER=1};
+
 class Barrier {
 public:
-    explicit Barrier(int numThreads);
+    explicit Barrier(int numThreads, barrier_mode_t mode = BLOCKING_BARRIER);
     ~Barrier() = default;
     void barrier();
 
 private:
+    void blockingBarrier();
+    void spinningBarrier();
+
+    const barrier_mode_t mode;
+
+    // BLOCKING_BARRIER
     std::mutex mutex;
     std::condition_variable cv;
     int count;
     int generation;
+
+    // SPINNING_BARRIER
+    std::atomic<int> remaining;
+    std::atomic<int> sense;     // flipped by the last thread to arrive, also the futex word
+    std::atomic<int> sleepers;  // threads that may be in futex wait
+
     const int numThreads;
 };
 
@@ -0,0 +1,22 @@
+#ifndef INPUTSOURCE_H
+#define INPUTSOURCE_H
+#include <vector>
+
+// Input that a job pulls chunk by chunk while it maps, instead of a vector
+// built up front. Every worker of the job calls next on its own, at the same
+// time, so sources must be thread safe.
+template <class Pair>
+class InputSource {
+public:
+    virtual ~InputSource() {}
+
+    // Replaces pairs with the next chunk of input, which may be empty.
+    // Returns false once the input is exhausted.
+    virtual bool next(std::vector<Pair>& pairs) = 0;
+
+    // Called with every chunk once it is mapped, before the worker pulls the
+    // next one, e.g. to free what the pairs point at.
+    virtual void release(std::vector<Pair>&) {}
+};
+
+#endif // INPUTSOURCE_H
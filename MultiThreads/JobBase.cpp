@@ -0,0 +1,197 @@
+#include "JobBase.h"
+#include "SystemError.h"
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <system_error>
+#include <vector>
+
+// Finer spans each traced worker keeps, 2MiB worth of 32-byte TraceEvents
+static const size_t TRACE_RING_CAPACITY = 1 << 16;
+
+JobBase::JobBase(int numThreads, int totalInput, const JobOptions& options)
+        : num_threads(numThreads),
+          total_input(totalInput),
+          barrier(numThreads, options.barrierMode),
+          thread_stats(numThreads),
+          state_word(packState(UNDEFINED_STAGE, 0, 0)),
+          running_workers(numThreads),
+          done(false),
+          on_complete(options.onComplete),
+          on_complete_data(options.onCompleteData),
+          weight(options.weight),
+          finish_time(0),
+          trace_file(options.traceFile ? options.traceFile : "") {
+    for (ThreadStats& stats : thread_stats) {
+        stats.barrierWaits.reserve(4);  // Allocated up front, like the rest
+    }
+    if (options.traceFile != nullptr) {
+        trace_rings.assign(numThreads, TraceRing(TRACE_RING_CAPACITY));
+    }
+}
+
+int JobBase::workersFor(int requested, const JobOptions& options) {
+    return WorkerPool::instance().share(requested, options.weight);
+}
+
+void JobBase::launch() {
+    start_time = Clock::now();
+    setStage(MAP_STAGE);
+
+    std::vector<std::function<void()>> tasks;
+    for (int i = 0; i < num_threads; ++i) {
+        tasks.emplace_back([this, i] {
+            runWorker(i);
+            finishWorker();
+        });
+    }
+
+    try {
+        WorkerPool::instance().runGang(tasks, weight);
+    } catch (const std::system_error& e) {
+        systemError("failed to create thread");
+    }
+}
+
+// Called by every worker once it is done with the job. The last one runs
+// onComplete and wakes wait, after which the job may be deleted at any moment.
+void JobBase::finishWorker() {
+    std::unique_lock<std::mutex> lock(done_mutex);
+    if (--running_workers > 0) {
+        return;
+    }
+    finish_time = elapsedMicros();
+
+    if (on_complete != nullptr) {
+        lock.unlock();  // getJobState and waitForJobFor may be called meanwhile
+        on_complete(static_cast<JobHandle>(this), on_complete_data);
+        lock.lock();
+    }
+    done = true;
+    done_cv.notify_all();
+}
+
+void JobBase::wait() {
+    std::unique_lock<std::mutex> lock(done_mutex);
+    done_cv.wait(lock, [this] { return done; });
+}
+
+bool JobBase::waitFor(std::chrono::nanoseconds timeout) {
+    std::unique_lock<std::mutex> lock(done_mutex);
+    return done_cv.wait_for(lock, timeout, [this] { return done; });
+}
+
+void JobBase::getStats(JobStats* stats) {
+    wait();
+
+    stats->totalTime = finish_time;
+    stats->threads = thread_stats;
+    std::fill(std::begin(stats->groupSizes), std::end(stats->groupSizes), 0ULL);
+    for (const ThreadStats& thread : thread_stats) {
+        for (int i = 0; i < GROUP_SIZE_BUCKETS; ++i) {
+            stats->groupSizes[i] += thread.groupSizes[i];
+        }
+    }
+}
+
+void JobBase::flushTrace() {
+    if (tracing()) {
+        writeChromeTrace(trace_file.c_str(), trace_rings);
+    }
+}
+
+void JobBase::waitBarrier(int thread_id) {
+    double start = elapsedMicros();
+    barrier.barrier();
+    double end = elapsedMicros();
+    thread_stats[thread_id].barrierWaits.push_back(end - start);
+    tracePhase(thread_id, "barrier", start, end);
+}
+
+void JobBase::setStage(stage_t new_stage) {
+    uint64_t word = state_word.load();
+    while (true) {
+        if (static_cast<stage_t>(word >> (2 * COUNT_BITS)) >= new_stage) {
+            return;
+        }
+
+        uint64_t next;
+        if (new_stage == MAP_STAGE) {
+            next = packState(new_stage, 0, static_cast<uint64_t>(total_input));
+        } else if (new_stage == SHUFFLE_STAGE) {
+            next = packState(new_stage, 0, 0);
+        } else {
+            next = packState(new_stage, word & COUNT_MASK, (word >> COUNT_BITS) & COUNT_MASK);
+        }
+        if (state_word.compare_exchange_weak(word, next)) {
+            return;
+        }
+    }
+}
+
+void JobBase::addReduceWork(size_t units) {
+    addCounts(0, units);
+}
+
+void JobBase::addMapWork(size_t units) {
+    addCounts(0, units);
+}
+
+void JobBase::addProgress(size_t units) {
+    addCounts(units, 0);
+}
+
+// Streamed input and spilled pairs can add up to more than a count holds, so
+// both counts stop at COUNT_MASK instead of carrying into the next field.
+void JobBase::addCounts(uint64_t processed, uint64_t total) {
+    const uint64_t limit = COUNT_MASK;
+    uint64_t word = state_word.load();
+    while (true) {
+        uint64_t new_processed = std::min((word & COUNT_MASK) + processed, limit);
+        uint64_t new_total = std::min(((word >> COUNT_BITS) & COUNT_MASK) + total, limit);
+        uint64_t next = packState(static_cast<stage_t>(word >> (2 * COUNT_BITS)), new_processed, new_total);
+        if (state_word.compare_exchange_weak(word, next)) {
+            return;
+        }
+    }
+}
+
+void JobBase::getState(JobState* state) {
+    *state = JobState{UNDEFINED_STAGE, 0.0f};
+
+    uint64_t word = state_word.load();
+    stage_t current_stage = static_cast<stage_t>(word >> (2 * COUNT_BITS));
+    int processed = static_cast<int>(word & COUNT_MASK);
+    int total = static_cast<int>((word >> COUNT_BITS) & COUNT_MASK);
+
+    float percentage = 0.0f;
+
+    switch (current_stage) {
+        case MAP_STAGE:
+            if (total > 0) {
+                percentage = 100.0f * processed / total;
+            }
+            break;
+
+        case SHUFFLE_STAGE:
+            percentage = 0.0f;
+            break;
+
+        case REDUCE_STAGE:
+            if (total > 0) {
+                percentage = 100.0f * processed / total;
+            } else {
+                percentage = 100.0f;  // ✅ Initialize explicitly to avoid garbage
+            }
+            break;
+
+        default:
+            percentage = 0.0f;
+            break;
+    }
+
+    state->stage = current_stage;
+    state->percentage = percentage;
+}
@@ -0,0 +1,164 @@
+#ifndef JOBBASE_H
+#define JOBBASE_H
+
+#include "MapReduceFramework.h"
+#include "Barrier.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// The part of a MapReduce job that does not depend on its key and value types:
+// stage and progress accounting, the workers' Barrier, dispatching the workers
+// and waiting for them. A JobHandle always points at a JobBase.
+class JobBase {
+public:
+    virtual ~JobBase() = default;
+
+    void wait();
+    bool waitFor(std::chrono::nanoseconds timeout);
+    void getState(JobState* state);
+
+    // Waits for the job, see getJobStats.
+    void getStats(JobStats* stats);
+
+    // Writes the trace file, if the job is traced. The job must be done. The
+    // trace is a diagnostic: if the file cannot be written, it is dropped.
+    void flushTrace();
+
+    // How many workers a job asking for requested gets, see setWorkerBudget.
+    static int workersFor(int requested, const JobOptions& options);
+
+protected:
+    JobBase(int numThreads, int totalInput, const JobOptions& options);
+
+    // Borrows num_threads workers from the WorkerPool and runs runWorker on
+    // each of them. Must be called once the job is fully constructed.
+    void launch();
+
+    // The whole life of one worker in this job: map, shuffle and reduce.
+    virtual void runWorker(int thread_id) = 0;
+
+    // Stages only move forward, whatever order the workers report them in.
+    // Entering MAP_STAGE or SHUFFLE_STAGE starts counting from zero again,
+    // REDUCE_STAGE counts towards the work registered during shuffle.
+    void setStage(stage_t stage);
+
+    // Adds to the amount of reduce work that addProgress counts towards:
+    // groups, or pairs when the groups are not known before reduce starts.
+    void addReduceWork(size_t units);
+
+    // Adds to the map input that addProgress counts towards, for input that
+    // arrives while the job maps.
+    void addMapWork(size_t units);
+
+    // Counts processed input pairs during map, and reduce work during reduce.
+    // Both counts saturate at COUNT_MASK (2^31 - 1 units) rather than carry
+    // into the field above: a stage with more work than that reports 100%
+    // once that many units are processed.
+    void addProgress(size_t units);
+
+    // ---------- Stats ----------
+    // Every worker only writes its own ThreadStats, and getStats reads them
+    // once the workers are done, so recording takes no locks or atomics.
+
+    double elapsedMicros() const {
+        return std::chrono::duration<double, std::micro>(Clock::now() - start_time).count();
+    }
+
+    // barrier.barrier(), recording the wait in thread_id's stats.
+    void waitBarrier(int thread_id);
+
+    void countGroup(int thread_id, size_t size) {
+        ThreadStats& stats = thread_stats[thread_id];
+        stats.reducedGroups++;
+        int bucket = 63 - __builtin_clzll(static_cast<unsigned long long>(size));
+        stats.groupSizes[std::min(bucket, GROUP_SIZE_BUCKETS - 1)]++;
+    }
+
+    // ---------- Tracing ----------
+    // With JobOptions::traceFile, every worker records spans into a
+    // TraceRing of its own, which flushTrace writes out. Phases and barrier
+    // waits go through tracePhase so that the finer spans of a long reduce
+    // never push them out of the ring.
+
+    bool tracing() const { return !trace_rings.empty(); }
+
+    void tracePhase(int thread_id, const char* name, double start, double end) {
+        if (tracing()) {
+            trace_rings[thread_id].recordPhase(name, start, end);
+        }
+    }
+
+    // Traces the scope it lives in. Reads no clock when the job is not traced.
+    class TraceScope {
+    public:
+        TraceScope(JobBase* job, int thread_id, const char* name, long long items = -1)
+                : job(job->tracing() ? job : nullptr),
+                  thread_id(thread_id),
+                  name(name),
+                  items(items),
+                  start(this->job ? job->elapsedMicros() : 0) {}
+
+        ~TraceScope() {
+            if (job) {
+                job->trace_rings[thread_id].record(name, start, job->elapsedMicros(), items);
+            }
+        }
+
+    private:
+        JobBase* job;
+        int thread_id;
+        const char* name;
+        long long items;
+        double start;
+    };
+
+    const int num_threads;
+    const int total_input;
+    Barrier barrier;
+    std::vector<ThreadStats> thread_stats;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    void finishWorker();
+    void addCounts(uint64_t processed, uint64_t total);
+
+    // stage, processed and total in one word, so that getState reads them
+    // together without a lock. Both counts are at most INT_MAX, see addProgress.
+    static constexpr int COUNT_BITS = 31;
+    static constexpr uint64_t COUNT_MASK = (uint64_t(1) << COUNT_BITS) - 1;
+
+    static uint64_t packState(stage_t stage, uint64_t processed, uint64_t total) {
+        return (uint64_t(stage) << (2 * COUNT_BITS)) | (total << COUNT_BITS) | processed;
+    }
+
+    std::atomic<uint64_t> state_word; // stage | total | processed, from the high bits
+
+    // Workers come from the shared WorkerPool, so completion is tracked per
+    // job rather than by joining threads.
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+    int running_workers;
+    bool done; // workers finished and onComplete returned
+
+    void (*on_complete)(JobHandle job, void* data);
+    void* on_complete_data;
+    double weight;
+
+    Clock::time_point start_time;
+    double finish_time; // microseconds, set by the last worker
+
+    std::string trace_file;
+    std::vector<TraceRing> trace_rings; // one per worker, empty when not tracing
+};
+
+#endif // JOBBASE_H
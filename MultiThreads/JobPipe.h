@@ -0,0 +1,126 @@
+#ifndef JOBPIPE_H
+#define JOBPIPE_H
+#include "OutputSink.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+template <class K1, class V1, class K2, class V2, class K3, class V3, class Less>
+class MapReduceJob;
+
+// Hands the output of MapReduceJobs to the map phase of another one without
+// copying it. Every worker of a writing job moves its output pairs in as
+// whole chunks while it reduces, and the reading job maps each chunk in place
+// as soon as it arrives, while the writers are still reducing.
+//
+//     JobPipe<std::pair<std::string, int>> counts;
+//     JobHandle count = Count::start(counter, input, counts, 8);
+//     JobHandle rank = Rank::start(ranker, counts, output, 8);
+//
+// Unlike other sinks, a pipe may take the output of several jobs. They must
+// all be started before the job reading the pipe, and only one job may read
+// it. A chunk is freed as soon as the reading job has mapped all of it, so
+// its map must not keep references to the input pairs.
+template <class Pair>
+class JobPipe : public OutputSink<Pair> {
+public:
+    typedef std::vector<Pair> Chunk;
+
+    JobPipe() : writers(0), freed(0), read_chunk(0), read_offset(0), unread(0) {}
+    JobPipe(const JobPipe&) = delete;
+    JobPipe& operator=(const JobPipe&) = delete;
+
+    void open(int workers) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        writers += workers;
+    }
+
+    void write(int, Chunk& chunk) override {
+        if (chunk.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        unread += chunk.size();
+        written.emplace_back();
+        written.back().pairs = std::move(chunk);
+        cv.notify_all();
+    }
+
+    void close(int) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--writers == 0) {
+            cv.notify_all();
+        }
+    }
+
+private:
+    template <class, class, class, class, class, class, class>
+    friend class MapReduceJob;
+
+    // Claims the next pairs [begin, end), at most max of them and all from one
+    // chunk, waiting for the writers when every written pair is claimed.
+    // fresh is the chunk's size when this is its first claim, and 0 otherwise;
+    // left is the number of written pairs still unclaimed. The pairs stay put
+    // until the claim is passed to release. Returns false once the writers
+    // are done and every pair is claimed.
+    bool read(size_t max, const Pair*& begin, const Pair*& end, size_t& fresh, size_t& left, size_t& claim) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return read_chunk < written.size() || writers == 0; });
+        if (read_chunk == written.size()) {
+            return false;
+        }
+
+        Slot& slot = written[read_chunk];
+        const Chunk& chunk = slot.pairs;
+        size_t count = std::min(max, chunk.size() - read_offset);
+        fresh = read_offset == 0 ? chunk.size() : 0;
+        begin = chunk.data() + read_offset;
+        end = begin + count;
+        claim = freed + read_chunk;
+        slot.mapping++;
+
+        read_offset += count;
+        if (read_offset == chunk.size()) {
+            read_chunk++;
+            read_offset = 0;
+        }
+        unread -= count;
+        left = unread;
+        return true;
+    }
+
+    // Ends a claim made by read. Frees the chunk once all of it is claimed
+    // and no claim on it is left, and drops the freed chunks at the front.
+    void release(size_t claim) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t index = claim - freed;
+        if (--written[index].mapping == 0 && index < read_chunk) {
+            Chunk().swap(written[index].pairs);
+        }
+        while (read_chunk > 0 && written.front().mapping == 0) {
+            written.pop_front();
+            freed++;
+            read_chunk--;
+        }
+    }
+
+    struct Slot {
+        Chunk pairs;
+        size_t mapping = 0; // claims not yet released
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Slot> written; // never moves a chunk, so claimed pairs stay put
+    int writers;              // workers of the writing jobs not yet done
+    size_t freed;             // chunks dropped from the front of written
+    size_t read_chunk;
+    size_t read_offset;
+    size_t unread;
+};
+
+#endif // JOBPIPE_H
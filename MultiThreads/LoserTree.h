@@ -0,0 +1,61 @@
+#ifndef LOSERTREE_H
+#define LOSERTREE_H
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Tournament tree for merging k sorted sources. Every inner node holds the
+// source that lost the match played there, so once the winner's source
+// advances, only its path to the root is replayed: about log2(k)
+// comparisons per element instead of k for a linear scan.
+//
+// beats(a, b) tells whether the current element of source a comes out before
+// that of source b. An exhausted source must lose to every other one.
+template <class Beats>
+class LoserTree {
+public:
+    LoserTree(size_t sources, Beats beats) : k(sources), beats(beats), losers(std::max<size_t>(sources, 1)) {
+        losers[0] = k > 1 ? build(1) : 0;
+    }
+
+    // The source whose element comes out next.
+    size_t winner() const { return losers[0]; }
+
+    // Call after the winner's source moved on to its next element.
+    void replay() {
+        size_t winner = losers[0];
+        for (size_t node = (winner + k) / 2; node > 0; node /= 2) {
+            if (beats(losers[node], winner)) {
+                std::swap(losers[node], winner);
+            }
+        }
+        losers[0] = winner;
+    }
+
+private:
+    // Leaves are the nodes k to 2k - 1, leaf k + i being source i.
+    size_t build(size_t node) {
+        if (node >= k) {
+            return node - k;
+        }
+        size_t left = build(2 * node);
+        size_t right = build(2 * node + 1);
+        if (beats(right, left)) {
+            std::swap(left, right);
+        }
+        losers[node] = right;
+        return left;
+    }
+
+    size_t k;
+    Beats beats;
+    std::vector<size_t> losers; // losers[0] is the overall winner
+};
+
+template <class Beats>
+LoserTree<Beats> makeLoserTree(size_t sources, Beats beats) {
+    return LoserTree<Beats>(sources, beats);
+}
+
+#endif // LOSERTREE_H
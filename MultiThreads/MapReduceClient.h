@@ -3,6 +3,9 @@
 
 #include <vector>  //std::vector
 #include <utility> //std::pair
+#include <cstddef> //size_t
+#include <cstdint> //uint64_t
+#include <string>  //std::string
 
 // input key and value.
 // the key, value for the map function and the MapReduceFramework
@@ -26,6 +29,14 @@ class K2
 public:
     virtual ~K2() {}
     virtual bool operator<(const K2 &other) const = 0;
+
+    // optional order-preserving prefix of the key: if a < b then
+    // a.normalizedPrefix() <= b.normalizedPrefix(), and keys where neither is
+    // less than the other must have equal prefixes. the framework keeps it
+    // next to the key pointer and only calls operator< on equal prefixes,
+    // e.g. a string key can return its first 8 bytes, big-endian. used only
+    // for clients whose hasNormalizedPrefix returns true.
+    virtual uint64_t normalizedPrefix() const { return 0; }
 };
 
 class V2
@@ -68,6 +79,61 @@ public:
     // calls emit3(K3, V3, context) any number of times (usually once)
     // to output (K3, V3) pairs.
     virtual void reduce(const IntermediateVec *pairs, void *context) const = 0;
+
+    // optional map-side combiner, enabled by returning true from hasCombiner.
+    // gets a single K2 key and a vector of several of its V2 values that one
+    // thread emitted, and returns a single pair standing for all of them.
+    // the combiner owns the pairs it gets, except for the one it returns.
+    // it may be called zero or more times per key, so reduce must accept
+    // both combined and uncombined values.
+    virtual bool hasCombiner() const { return false; }
+    virtual IntermediatePair combine(const IntermediateVec *pairs) const
+    {
+        return pairs->front();
+    }
+
+    // optional, return true if reduce gives the same result for a group as
+    // for the combine results of any split of that group into parts. when
+    // hasCombiner is true as well, HASH_SHUFFLE jobs then also use combine to
+    // split huge groups across workers. without a combiner, or under
+    // SORT_SHUFFLE, whose combiner leaves no huge groups, nothing is split.
+    virtual bool reduceIsAssociative() const { return false; }
+
+    // optional, return true if the K2 keys implement normalizedPrefix.
+    // without it, reduce and combine get the framework's own vector of
+    // pairs, while with it every group is copied out of the prefixed pairs.
+    virtual bool hasNormalizedPrefix() const { return false; }
+
+    // optional, used only by jobs started with HASH_SHUFFLE, enabled by
+    // returning true from hasKeyHash. keys that are equal must have equal
+    // hashes. without it, HASH_SHUFFLE jobs sort their keys like SORT_SHUFFLE.
+    virtual bool hasKeyHash() const { return false; }
+    virtual size_t keyHash(const K2 *) const { return 0; }
+
+    // optional, used only by jobs started with HASH_SHUFFLE.
+    virtual bool keysEqual(const K2 *a, const K2 *b) const
+    {
+        return !(*a < *b) && !(*b < *a);
+    }
+
+    // optional spill hooks, needed by jobs with a JobOptions::memoryBudget
+    // and enabled by returning true from canSpill. without them, such jobs
+    // keep every pair in memory as if they had no budget. pairBytes is the
+    // memory a pair holds, objects included. serialize appends a compact
+    // encoding of a pair to out and deserialize recreates the pair from it.
+    // releasePair frees a pair that the framework dropped after serializing
+    // it, the way reduce would.
+    virtual bool canSpill() const { return false; }
+    virtual size_t pairBytes(const IntermediatePair &) const
+    {
+        return sizeof(IntermediatePair);
+    }
+    virtual void serialize(const IntermediatePair &, std::string &) const {}
+    virtual IntermediatePair deserialize(const char *, size_t) const
+    {
+        return IntermediatePair(nullptr, nullptr);
+    }
+    virtual void releasePair(const IntermediatePair &) const {}
 };
 
 #endif // MAPREDUCECLIENT_H
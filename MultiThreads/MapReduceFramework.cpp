@@ -2,299 +2,377 @@
 #include "MapReduceFramework.h"
 #include "MapReduceClient.h"
 
-#include "Barrier.h"
-
-#include <thread>
-#include <vector>
-#include <mutex>
-#include <atomic>
-#include <condition_variable>
-#include <algorithm>
-#include <cstdio>
-#include <cstdlib>
-#include <iostream>
-
-// ---------- Forward declarations ----------
-struct JobContext;
-struct ThreadContext;
-void shuffle(JobContext* job);
-void reduceWorker(ThreadContext* tc);
-
-// ---------- ThreadContext ----------
-struct ThreadContext {
-    int thread_id;
-    JobContext* job;
+#include "JobBase.h"
+#include "MapReduceJob.h"
+#include "WorkerPool.h"
+
+#include <fstream>
+#include <iomanip>
+
+// ---------- PrefixedKey ----------
+// A K2* stored with its normalizedPrefix, so that most comparisons in the sort
+// and the merge are decided without touching the key object.
+struct PrefixedKey {
+    uint64_t prefix;
+    K2* key;
 };
 
-// ---------- JobContext ----------
-struct JobContext {
-    const MapReduceClient& client;
-    const InputVec& inputVec;
-    OutputVec& outputVec;
-
-    std::vector<std::thread> threads;
-    std::vector<ThreadContext> thread_contexts;
-
-    std::atomic<int> input_index;
-    std::atomic<int> map_progress;
-    std::vector<IntermediateVec> intermediate_vectors;
-
-    std::mutex output_mutex;
-    std::mutex state_mutex;
-    JobState state;
-
-    std::vector<IntermediateVec> shuffled_queue;
-    std::mutex queue_mutex;
-
-    std::atomic<int> reduce_progress;
-    int total_reduce_groups; // total number of grouped vectors
+static PrefixedKey prefixed(K2* key) {
+    return PrefixedKey{key ? key->normalizedPrefix() : 0, key};
+}
 
-    Barrier* barrier;
+struct PrefixedLess {
+    bool operator()(const PrefixedKey& a, const PrefixedKey& b) const {
+        if (a.prefix != b.prefix) {
+            return a.prefix < b.prefix;
+        }
+        return *a.key < *b.key;
+    }
+};
 
-    int total_input;
-    int num_threads;
-    bool joined;
+// The prefixes order the keys, but do not tell them apart.
+template <>
+struct RadixKey<PrefixedKey, PrefixedLess> {
+    static const bool available = true;
+    static const bool exact = false;
 
-    JobContext(const MapReduceClient& client,
-               const InputVec& inputVec,
-               OutputVec& outputVec,
-               int numThreads)
-            : client(client),
-              inputVec(inputVec),
-              outputVec(outputVec),
-              input_index(0),
-              map_progress(0),
-              state({UNDEFINED_STAGE, 0}),
-              reduce_progress(0),
-              total_reduce_groups(0),
-              barrier(new Barrier(numThreads)),
-              total_input(static_cast<int>(inputVec.size())),
-              num_threads(numThreads),
-              joined(false) {}
+    static uint64_t get(const PrefixedKey& key) { return key.prefix; }
 };
 
-// ---------- emit2 ----------
-void emit2(K2* key, V2* value, void* context) {
-    auto* tc = static_cast<ThreadContext*>(context);
-    JobContext* job = tc->job;
+// The pointer-based API runs on the typed engine with the client's pointers as
+// keys and values. Clients whose keys have a normalizedPrefix get
+// PrefixedPointerJob, ordered by prefix and then through K2::operator<. The
+// rest get PointerJob, whose pairs are the client's own, so groups reach
+// reduce and combine without a copy.
+typedef MapReduceJob<K1*, V1*, K2*, V2*, K3*, V3*, DerefLess<K2>> PointerJob;
+typedef MapReduceJob<K1*, V1*, PrefixedKey, V2*, K3*, V3*, PrefixedLess> PrefixedPointerJob;
 
-    job->intermediate_vectors[tc->thread_id].emplace_back(key, value);
+static K2* unprefixed(K2* key) {
+    return key;
 }
-// ****************************** ONLY WORKS FOR /r**************************
-bool isCarriageReturnKey(K3* key) {
-    // Assume KChar has vtable then 'char c' immediately after.
-    // The 'c' will be at offset sizeof(void*) (vtable ptr size)
-    char c = *(char*)(((char*)key) + sizeof(void*));
-    return c == 13;
+
+static K2* unprefixed(const PrefixedKey& key) {
+    return key.key;
 }
-void emit3(K3* key, V3* value, void* context) {
-    auto* tc = static_cast<ThreadContext*>(context);
-    JobContext* job = tc->job;
-    std::lock_guard<std::mutex> lock(job->output_mutex);
-    job->outputVec.emplace_back(key, value);
+
+static const IntermediatePair& unprefixed(const PointerJob::IntermediatePair& pair) {
+    return pair;
 }
 
+static IntermediatePair unprefixed(const PrefixedPointerJob::IntermediatePair& pair) {
+    return IntermediatePair(pair.first.key, pair.second);
+}
 
-// ---------- Map Worker Thread Function ----------
-void mapWorker(ThreadContext* tc) {
-    JobContext* job = tc->job;
+static const IntermediateVec& unprefixed(const PointerJob::IntermediateVec& pairs) {
+    return pairs;
+}
 
-    {
-        std::lock_guard<std::mutex> lock(job->state_mutex);
-        job->state.stage = MAP_STAGE;
+// Valid until the calling thread's next call. Neither reduce nor combine is
+// ever reentered, so every worker needs a single buffer, which only stays as
+// large as recent groups.
+static const IntermediateVec& unprefixed(const PrefixedPointerJob::IntermediateVec& pairs) {
+    thread_local IntermediateVec buffer;
+    if (buffer.capacity() > 4 * pairs.size() + 1024) {
+        IntermediateVec().swap(buffer);
     }
-
-    int index = job->input_index.fetch_add(1);
-    while (index < job->total_input) {
-        const InputPair& pair = job->inputVec[index];
-        job->client.map(pair.first, pair.second, tc);
-        job->map_progress++;
-        index = job->input_index.fetch_add(1);
+    buffer.clear();
+    for (const PrefixedPointerJob::IntermediatePair& pair : pairs) {
+        buffer.emplace_back(pair.first.key, pair.second);
     }
+    return buffer;
+}
 
-    IntermediateVec& vec = job->intermediate_vectors[tc->thread_id];
-    std::sort(vec.begin(), vec.end(), [](const IntermediatePair& a, const IntermediatePair& b) {
-        return *(a.first) < *(b.first);
-    });
+// Turns a client key into a key of Job.
+template <class Job>
+static typename Job::IntermediatePair::first_type jobKey(K2* key);
 
-    job->barrier->barrier();  // Sync before shuffle/reduce
-    if (tc->thread_id == 0) {
-        shuffle(job);
-    }
-    reduceWorker(tc);
+template <>
+K2* jobKey<PointerJob>(K2* key) {
+    return key;
 }
 
-// ---------- startMapReduceJob ----------
-JobHandle startMapReduceJob(const MapReduceClient& client,
-                            const InputVec& inputVec,
-                            OutputVec& outputVec,
-                            int multiThreadLevel) {
+template <>
+PrefixedKey jobKey<PrefixedPointerJob>(K2* key) {
+    return prefixed(key);
+}
+
+template <class Job>
+static typename Job::IntermediatePair jobPair(const IntermediatePair& pair) {
+    return typename Job::IntermediatePair(jobKey<Job>(pair.first), pair.second);
+}
 
-    auto* job = new JobContext(client, inputVec, outputVec, multiThreadLevel);
+// ---------- PointerContext ----------
+// What map and reduce get as their void* context, whichever job runs them.
+class PointerContext {
+public:
+    virtual void emit2(K2* key, V2* value) = 0;
+    virtual void emit2Batch(const IntermediatePair* pairs, size_t count) = 0;
+    virtual void emit3(K3* key, V3* value) = 0;
+    virtual void emit3Batch(const OutputPair* pairs, size_t count) = 0;
+    virtual Arena& arena() = 0;
+
+protected:
+    ~PointerContext() {}
+};
 
-    job->intermediate_vectors.resize(multiThreadLevel);
-    job->thread_contexts.resize(multiThreadLevel);
+template <class Job>
+class JobPointerContext final : public PointerContext {
+public:
+    explicit JobPointerContext(typename Job::Context& context) : context(context) {}
 
-    for (int i = 0; i < multiThreadLevel; ++i) {
-        job->thread_contexts[i] = { i, job };
+    void emit2(K2* key, V2* value) override {
+        context.emit2(jobKey<Job>(key), value);
     }
 
-    try {
-        for (int i = 0; i < multiThreadLevel; ++i) {
-            job->threads.emplace_back(mapWorker, &job->thread_contexts[i]);
-        }
-    } catch (const std::system_error& e) {
-        std::cout << "system error: failed to create thread" << std::endl;
-        exit(1);
+    void emit2Batch(const IntermediatePair* pairs, size_t count) override {
+        context.emit2Batch(pairs, count, jobPair<Job>);
     }
 
-    return static_cast<JobHandle>(job);
+    void emit3(K3* key, V3* value) override { context.emit3(key, value); }
 
-}
+    void emit3Batch(const OutputPair* pairs, size_t count) override { context.emit3Batch(pairs, count); }
+
+    Arena& arena() override { return context.arena(); }
+
+private:
+    typename Job::Context& context;
+};
 
-void shuffle(JobContext* job) {
-    {
-        std::lock_guard<std::mutex> lock(job->state_mutex);
-        job->state.stage = SHUFFLE_STAGE;
+// ---------- ClientAdapter ----------
+// Presents a MapReduceClient as a Client of PointerJob or PrefixedPointerJob.
+// Groups reach the client as a plain IntermediateVec, without the prefixes.
+template <class Job>
+class ClientAdapter : public Job::Client {
+public:
+    typedef typename Job::IntermediatePair JobPair;
+    typedef typename JobPair::first_type JobKey;
+    typedef typename Job::IntermediateVec JobVec;
+
+    explicit ClientAdapter(const MapReduceClient& client) : client(client) {}
+
+    void map(K1* const& key, V1* const& value, typename Job::Context& context) const override {
+        JobPointerContext<Job> pointer_context(context);
+        client.map(key, value, &pointer_context);
     }
 
-    auto& vectors = job->intermediate_vectors;
+    void reduce(const JobVec& pairs, typename Job::Context& context) const override {
+        JobPointerContext<Job> pointer_context(context);
+        client.reduce(&unprefixed(pairs), &pointer_context);
+    }
 
-    while (true) {
-        K2* maxKey = nullptr;
+    bool hasCombiner() const override { return client.hasCombiner(); }
 
-        // Step 1: Find the largest key among back elements
-        for (const auto& vec : vectors) {
-            if (!vec.empty()) {
-                K2* candidate = vec.back().first;
-                if (!maxKey || (*maxKey < *candidate)) {
-                    maxKey = candidate;
-                }
-            }
-        }
+    JobPair combine(const JobVec& pairs) const override {
+        return jobPair<Job>(client.combine(&unprefixed(pairs)));
+    }
 
-        if (!maxKey) {
-            break;  // All vectors are empty
-        }
+    bool reduceIsAssociative() const override { return client.reduceIsAssociative(); }
 
-        // Step 2: Collect all pairs with this maxKey
-        IntermediateVec group;
+    bool hasKeyHash() const override { return client.hasKeyHash(); }
 
-        for (auto& vec : vectors) {
-            while (!vec.empty() && !(*vec.back().first < *maxKey) && !(*maxKey < *vec.back().first)) {
-                group.push_back(vec.back());
-                vec.pop_back();
-            }
-        }
+    size_t keyHash(const JobKey& key) const override { return client.keyHash(unprefixed(key)); }
 
-        job->shuffled_queue.push_back(std::move(group));
-        job->total_reduce_groups++;
+    bool keysEqual(const JobKey& a, const JobKey& b) const override {
+        return client.keysEqual(unprefixed(a), unprefixed(b));
     }
 
-}
-void reduceWorker(ThreadContext* tc) {
-    JobContext* job = tc->job;
+    bool canSpill() const override { return client.canSpill(); }
 
+    size_t pairBytes(const JobPair& pair) const override {
+        return client.pairBytes(unprefixed(pair));
+    }
 
-    job->barrier->barrier();  // Ensure all threads completed shuffle
+    void serialize(const JobPair& pair, std::string& out) const override {
+        client.serialize(unprefixed(pair), out);
+    }
 
-    {
-        std::lock_guard<std::mutex> lock(job->state_mutex);
-        job->state.stage = REDUCE_STAGE;
+    JobPair deserialize(const char* data, size_t size) const override {
+        return jobPair<Job>(client.deserialize(data, size));
     }
 
-    while (true) {
-        IntermediateVec group;
+    void releasePair(const JobPair& pair) const override {
+        client.releasePair(unprefixed(pair));
+    }
 
-        {
-            std::lock_guard<std::mutex> lock(job->queue_mutex);
-            if (job->shuffled_queue.empty()) {
-                break;
-            }
+private:
+    const MapReduceClient& client;
+};
 
-            group = std::move(job->shuffled_queue.back());
-            job->shuffled_queue.pop_back();
-        }
+// ---------- JobContext ----------
+// The adapter is a base so that it is constructed before, and destroyed after,
+// the job that refers to it.
+template <class Job>
+struct JobContext : private ClientAdapter<Job>, public Job {
+    JobContext(const MapReduceClient& client,
+               typename Job::Input input,
+               typename Job::Output output,
+               int numThreads,
+               const JobOptions& options)
+            : ClientAdapter<Job>(client),
+              Job(*this, input, output, numThreads, options) {}
+
+    using Job::launch;
+};
 
-        job->client.reduce(&group, tc);  // calls emit3 internally
-        job->reduce_progress++;
-    }
+// ---------- emit2 ----------
+void emit2(K2* key, V2* value, void* context) {
+    static_cast<PointerContext*>(context)->emit2(key, value);
+}
+void emit2Batch(const IntermediatePair* pairs, size_t count, void* context) {
+    static_cast<PointerContext*>(context)->emit2Batch(pairs, count);
 }
 
-void waitForJob(JobHandle handle) {
-    auto* job = static_cast<JobContext*>(handle);
+// ****************************** ONLY WORKS FOR /r**************************
+bool isCarriageReturnKey(K3* key) {
+    // Assume KChar has vtable then 'char c' immediately after.
+    // The 'c' will be at offset sizeof(void*) (vtable ptr size)
+    char c = *(char*)(((char*)key) + sizeof(void*));
+    return c == 13;
+}
+void emit3(K3* key, V3* value, void* context) {
+    static_cast<PointerContext*>(context)->emit3(key, value);
+}
 
-    // Only one thread may join
-    static std::mutex join_mutex;
-    std::lock_guard<std::mutex> lock(join_mutex);
+void emit3Batch(const OutputPair* pairs, size_t count, void* context) {
+    static_cast<PointerContext*>(context)->emit3Batch(pairs, count);
+}
 
-    if (!job->joined) {
-        for (std::thread& t : job->threads) {
-            if (t.joinable()) {
-                t.join();
-            }
-        }
-        job->joined = true;
-    }
+Arena* contextArena(void* context) {
+    return &static_cast<PointerContext*>(context)->arena();
 }
 
+// ---------- startMapReduceJob ----------
+template <class Job>
+static JobBase* launchJob(const MapReduceClient& client,
+                          typename Job::Input input,
+                          typename Job::Output output,
+                          int numThreads,
+                          const JobOptions& options) {
+    auto* job = new JobContext<Job>(client, input, output, numThreads, options);
+    job->launch();
+    return job;
+}
 
-void getJobState(JobHandle handle, JobState* state) {
-    *state = JobState{UNDEFINED_STAGE, 0.0f};
-    auto* job = static_cast<JobContext*>(handle);
+template <class Input, class Output>
+static JobHandle startJob(const MapReduceClient& client,
+                          Input& input,
+                          Output& output,
+                          int multiThreadLevel,
+                          const JobOptions& options) {
+    int numThreads = JobBase::workersFor(multiThreadLevel, options);
+    JobBase* job = client.hasNormalizedPrefix()
+            ? launchJob<PrefixedPointerJob>(client, input, output, numThreads, options)
+            : launchJob<PointerJob>(client, input, output, numThreads, options);
+    return static_cast<JobHandle>(job);
+}
 
-    stage_t current_stage;
-    {
-        std::lock_guard<std::mutex> lock(job->state_mutex);
-        current_stage = job->state.stage;
-    }
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            const InputVec& inputVec,
+                            OutputVec& outputVec,
+                            int multiThreadLevel,
+                            const JobOptions& options) {
+    return startJob(client, inputVec, outputVec, multiThreadLevel, options);
+}
 
-    float percentage = 0.0f;
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            InputSource<InputPair>& inputSource,
+                            OutputVec& outputVec,
+                            int multiThreadLevel,
+                            const JobOptions& options) {
+    return startJob(client, inputSource, outputVec, multiThreadLevel, options);
+}
+
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            const InputVec& inputVec,
+                            OutputSink<OutputPair>& outputSink,
+                            int multiThreadLevel,
+                            const JobOptions& options) {
+    return startJob(client, inputVec, outputSink, multiThreadLevel, options);
+}
 
-    switch (current_stage) {
-        case MAP_STAGE:
-            percentage = 100.0f * job->map_progress.load() / job->total_input;
-            break;
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            InputSource<InputPair>& inputSource,
+                            OutputSink<OutputPair>& outputSink,
+                            int multiThreadLevel,
+                            const JobOptions& options) {
+    return startJob(client, inputSource, outputSink, multiThreadLevel, options);
+}
 
-        case SHUFFLE_STAGE:
-            percentage = 0.0f;
-            break;
+void waitForJob(JobHandle handle) {
+    static_cast<JobBase*>(handle)->wait();
+}
 
-        case REDUCE_STAGE:
-            if (job->total_reduce_groups > 0) {
-                percentage = 100.0f * job->reduce_progress.load() / job->total_reduce_groups;
-            } else {
-                percentage = 100.0f;  // ✅ Initialize explicitly to avoid garbage
-            }
-            break;
+bool waitForJobFor(JobHandle handle, std::chrono::nanoseconds timeout) {
+    return static_cast<JobBase*>(handle)->waitFor(timeout);
+}
 
-        default:
-            percentage = 0.0f;
-            break;
-    }
 
-    state->stage = current_stage;
-    state->percentage = percentage;
+void getJobState(JobHandle handle, JobState* state) {
+    static_cast<JobBase*>(handle)->getState(state);
 }
-#include <cstdio>
-void closeJobHandle(JobHandle handle) {
-    auto* job = static_cast<JobContext*>(handle);
 
+void closeJobHandle(JobHandle handle) {
+    auto* job = static_cast<JobBase*>(handle);
 
+    job->wait();
+    job->flushTrace();
+    delete job;
+}
 
-    // Join all threads, if not already joined
-    static std::mutex join_mutex;
-    std::lock_guard<std::mutex> lock(join_mutex);
+// ---------- getJobStats ----------
+static void writeCounts(std::ostream& out, const unsigned long long* counts, int size) {
+    out << "[";
+    for (int i = 0; i < size; ++i) {
+        out << (i ? ", " : "") << counts[i];
+    }
+    out << "]";
+}
 
-    if (!job->joined) {
-        for (std::thread& t : job->threads) {
-            if (t.joinable()) {
-                t.join();
-            }
+static void writeStatsJson(const JobStats& stats, std::ostream& out) {
+    out << std::fixed << std::setprecision(3);  // microseconds, to the nanosecond
+    out << "{\n  \"totalTime\": " << stats.totalTime << ",\n  \"groupSizes\": ";
+    writeCounts(out, stats.groupSizes, GROUP_SIZE_BUCKETS);
+    out << ",\n  \"threads\": [";
+    for (size_t t = 0; t < stats.threads.size(); ++t) {
+        const ThreadStats& thread = stats.threads[t];
+        out << (t ? "," : "") << "\n    {"
+            << "\"mapStart\": " << thread.mapStart
+            << ", \"mapEnd\": " << thread.mapEnd
+            << ", \"sortEnd\": " << thread.sortEnd
+            << ", \"shuffleStart\": " << thread.shuffleStart
+            << ", \"shuffleEnd\": " << thread.shuffleEnd
+            << ", \"reduceStart\": " << thread.reduceStart
+            << ", \"reduceEnd\": " << thread.reduceEnd
+            << ", \"barrierWaits\": [";
+        for (size_t i = 0; i < thread.barrierWaits.size(); ++i) {
+            out << (i ? ", " : "") << thread.barrierWaits[i];
         }
-        job->joined = true;
+        out << "], \"inputPairs\": " << thread.inputPairs
+            << ", \"emittedPairs\": " << thread.emittedPairs
+            << ", \"outputPairs\": " << thread.outputPairs
+            << ", \"reducedGroups\": " << thread.reducedGroups
+            << ", \"splitGroups\": " << thread.splitGroups
+            << ", \"groupSizes\": ";
+        writeCounts(out, thread.groupSizes, GROUP_SIZE_BUCKETS);
+        out << "}";
     }
+    out << "\n  ]\n}\n";
+}
 
-    delete job->barrier;
-    delete job;
+bool getJobStats(JobHandle handle, JobStats* stats, const char* jsonPath) {
+    static_cast<JobBase*>(handle)->getStats(stats);
+    if (jsonPath == nullptr) {
+        return true;
+    }
+
+    // The stats are diagnostics, so a bad path must not end the process
+    std::ofstream out(jsonPath);
+    if (out) {
+        writeStatsJson(*stats, out);
+    }
+    return static_cast<bool>(out);
+}
+
+void setWorkerBudget(int workers) {
+    WorkerPool::instance().setBudget(workers);
 }
@@ -2,6 +2,12 @@
 #define MAPREDUCEFRAMEWORK_H
 
 #include "MapReduceClient.h"
+#include "Arena.h"
+#include "Barrier.h"
+#include "InputSource.h"
+#include "OutputSink.h"
+
+#include <chrono>
 
 typedef void* JobHandle;
 
@@ -12,16 +18,136 @@ typedef struct {
     float percentage;
 } JobState;
 
+// SORT_SHUFFLE sorts every key with K2::operator<.
+// HASH_SHUFFLE groups keys with MapReduceClient::keyHash and keysEqual instead,
+// so no sorting takes place and groups reach reduce in no particular order.
+// clients whose hasKeyHash returns false get SORT_SHUFFLE either way, as
+// hashing every key alike would leave one worker to group them all.
+enum shuffle_mode_t {SORT_SHUFFLE=0, HASH_SHUFFLE=1};
+
+struct JobOptions {
+    shuffle_mode_t shuffleMode = SORT_SHUFFLE;
+
+    // bytes of intermediate pairs the job may hold in memory, 0 for no limit.
+    // past it, sorted runs are spilled to files in spillDirectory (nullptr for
+    // $TMPDIR, or /tmp), which needs the client's spill hooks. the budget is
+    // ignored for clients whose canSpill returns false, and only SORT_SHUFFLE
+    // jobs spill.
+    size_t memoryBudget = 0;
+    const char* spillDirectory = nullptr;
+
+    // how workers wait for each other between phases, see Barrier.h
+    barrier_mode_t barrierMode = BLOCKING_BARRIER;
+
+    // when set, closeJobHandle writes a Chrome trace-event JSON timeline of
+    // the job's workers to this file (see chrome://tracing or Perfetto). if
+    // the file cannot be written, the trace is dropped.
+    const char* traceFile = nullptr;
+
+    // optional capacity hints: the number of pairs the whole job is expected
+    // to emit with emit2 and emit3. every worker reserves its even share of
+    // them up front rather than growing its vectors as it goes.
+    size_t expectedIntermediatePairs = 0;
+    size_t expectedOutputPairs = 0;
+
+    // optional, called with onCompleteData once the job is done, on the
+    // worker that finished last and before waitForJob returns. it must not
+    // wait for or close the job, but may e.g. wake an event loop that will.
+    void (*onComplete)(JobHandle job, void* data) = nullptr;
+    void* onCompleteData = nullptr;
+
+    // share of the worker budget next to the other jobs, see setWorkerBudget.
+    // weights that are not positive and finite count as 1.0.
+    double weight = 1.0;
+};
+
+// groupSizes[i] counts the reduce groups of 2^i to 2^(i+1) - 1 pairs.
+const int GROUP_SIZE_BUCKETS = 32;
+
+// What one worker did, with times in microseconds since the job started. A
+// phase the worker skipped, such as the sort under HASH_SHUFFLE, ends where
+// it starts.
+struct ThreadStats {
+    double mapStart = 0;
+    double mapEnd = 0;
+    double sortEnd = 0;      // local sort, combine and sampling of the map output
+    double shuffleStart = 0;
+    double shuffleEnd = 0;
+    double reduceStart = 0;
+    double reduceEnd = 0;
+    std::vector<double> barrierWaits; // time spent in each barrier, in order
+
+    unsigned long long inputPairs = 0;   // pairs handed to map
+    unsigned long long emittedPairs = 0; // emit2 calls
+    unsigned long long outputPairs = 0;  // emit3 calls
+    unsigned long long reducedGroups = 0;
+    unsigned long long splitGroups = 0;  // of those, reduced in parts by several workers
+    unsigned long long groupSizes[GROUP_SIZE_BUCKETS] = {};
+};
+
+struct JobStats {
+    double totalTime = 0; // microseconds until the last worker finished
+    std::vector<ThreadStats> threads;
+    unsigned long long groupSizes[GROUP_SIZE_BUCKETS] = {}; // of all workers
+};
+
 void emit2 (K2* key, V2* value, void* context);
 void emit3 (K3* key, V3* value, void* context);
 
+// emit count pairs at once, which is cheaper than as many emit2 or emit3
+// calls for map and reduce functions that emit many pairs.
+void emit2Batch(const IntermediatePair* pairs, size_t count, void* context);
+void emit3Batch(const OutputPair* pairs, size_t count, void* context);
+
+// The arena of the worker that owns context. Objects made with
+// contextArena(context)->create<T>(...), e.g. the K2 and V2 passed to emit2,
+// are released all at once by closeJobHandle and must not be deleted by the
+// client. K3 and V3 outlive the job, so they must not come from the arena.
+Arena* contextArena(void* context);
+
 JobHandle startMapReduceJob(const MapReduceClient& client,
                             const InputVec& inputVec, OutputVec& outputVec,
-                            int multiThreadLevel);
+                            int multiThreadLevel,
+                            const JobOptions& options = JobOptions());
+
+// as above, but pulls the input from inputSource while mapping instead of
+// taking it all up front. the source outlives the job. a PointerLineSource
+// (see MappedLineReader.h) reads the lines of a text file this way.
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            InputSource<InputPair>& inputSource, OutputVec& outputVec,
+                            int multiThreadLevel,
+                            const JobOptions& options = JobOptions());
+
+// as above, but every worker passes its output to outputSink in chunks while
+// it reduces, instead of appending it to one vector. the sink outlives the job.
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            const InputVec& inputVec, OutputSink<OutputPair>& outputSink,
+                            int multiThreadLevel,
+                            const JobOptions& options = JobOptions());
+JobHandle startMapReduceJob(const MapReduceClient& client,
+                            InputSource<InputPair>& inputSource, OutputSink<OutputPair>& outputSink,
+                            int multiThreadLevel,
+                            const JobOptions& options = JobOptions());
 
 void waitForJob(JobHandle job);
+
+// waits at most timeout for the job, returns whether it is done. a zero
+// timeout polls without blocking.
+bool waitForJobFor(JobHandle job, std::chrono::nanoseconds timeout);
 void getJobState(JobHandle job, JobState* state);
 void closeJobHandle(JobHandle job);
 
+// Waits for the job like waitForJob, then fills stats. With a jsonPath, the
+// stats are also written to that file as JSON. returns false if that file
+// could not be written, in which case stats are filled all the same.
+bool getJobStats(JobHandle job, JobStats* stats, const char* jsonPath = nullptr);
+
+// caps the workers all jobs together run on, 0 lifts the cap, which is the
+// default. with a cap, a new job gets at most multiThreadLevel workers, its
+// weighted share of the budget next to the jobs not yet done, and waits until
+// that many are free. map, reduce and onComplete must then not start a job
+// and wait for it: the new job may queue for the very workers that wait.
+void setWorkerBudget(int workers);
+
 
 #endif //MAPREDUCEFRAMEWORK_H
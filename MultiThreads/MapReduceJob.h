@@ -0,0 +1,1174 @@
+#ifndef MAPREDUCEJOB_H
+#define MAPREDUCEJOB_H
+
+#include "Arena.h"
+#include "InputSource.h"
+#include "JobBase.h"
+#include "JobPipe.h"
+#include "LoserTree.h"
+#include "OutputSink.h"
+#include "SpillFile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Statically typed MapReduce job. Keys and values are stored by value in
+// contiguous vectors and K2 keys are compared with Less, which the compiler
+// can inline, instead of through virtual calls on heap objects.
+//
+//     typedef MapReduceJob<int, std::string, std::string, int, std::string, int> WordCount;
+//     class Counter : public WordCount::Client { ... };
+//     JobHandle job = WordCount::start(counter, input, output, 8);
+//     closeJobHandle(job);
+//
+// The returned JobHandle works with waitForJob, getJobState and closeJobHandle.
+// Rounds of a pipeline can be chained through a JobPipe instead of vectors,
+// input can be streamed from an InputSource and output to an OutputSink.
+// startMapReduceJob runs on one of two such jobs over the client's pointers:
+// PointerJob, ordered by DerefLess<K2>, or PrefixedPointerJob, which keeps
+// every K2* next to its normalizedPrefix, for clients whose
+// hasNormalizedPrefix returns true (see MapReduceFramework.cpp).
+
+// Orders pointers by the objects they point at.
+template <class T>
+struct DerefLess {
+    bool operator()(const T* a, const T* b) const { return *a < *b; }
+};
+
+// Lets sorted runs of K2 keys be radix sorted rather than compared. A
+// specialization has `available` set and a static `get` mapping every key to
+// a uint64_t such that less(a, b) implies get(a) <= get(b). When `exact`,
+// equal values also mean equal keys; otherwise the pairs whose values tie
+// are sorted with Less afterwards. Integral keys under std::less have one.
+template <class Key, class Less, class Enable = void>
+struct RadixKey {
+    static const bool available = false;
+};
+
+template <class Key>
+struct RadixKey<Key, std::less<Key>, typename std::enable_if<std::is_integral<Key>::value>::type> {
+    static const bool available = true;
+    static const bool exact = true;
+
+    static uint64_t get(Key key) {
+        // Flipping the sign bit orders negative numbers before positive ones
+        return std::is_signed<Key>::value
+               ? static_cast<uint64_t>(static_cast<int64_t>(key)) ^ (uint64_t(1) << 63)
+               : static_cast<uint64_t>(key);
+    }
+};
+
+// Workers claim map input in batches, guided-scheduling style: a batch is
+// sized to take about MAP_BATCH_TARGET so the shared counters are touched
+// rarely, but never exceeds an even share of half the remaining input, so the
+// batches shrink towards the end and the workers still finish together.
+const std::chrono::nanoseconds MAP_BATCH_TARGET(50000);
+
+// Owners and thieves claim at most REDUCE_MAX_BATCH reduce groups at a time,
+// and never more than half of what is left, so skewed deques still drain
+// evenly.
+const uint32_t REDUCE_MAX_BATCH = 16;
+
+// Under HASH_SHUFFLE, with a combiner and an associative reducer, groups of
+// more than a quarter of an even share of the pairs, and at least
+// SPLIT_MIN_PAIRS, are reduced in parts of that size by several workers.
+// SORT_SHUFFLE jobs never split: their combiner already collapsed every key
+// to one pair per run, so no group gets that large.
+const size_t SPLIT_MIN_PAIRS = 4096;
+
+// Runs shorter than RADIX_MIN_PAIRS are sorted with std::sort even when the
+// keys have a RadixKey, as the radix sort's passes cost more than they save.
+const size_t RADIX_MIN_PAIRS = 1024;
+
+// Every SPILL_INDEX_STRIDE-th pair of a spilled run stays in memory as a
+// sparse index of the run.
+const size_t SPILL_INDEX_STRIDE = 1024;
+
+// Workers writing to an OutputSink, such as a JobPipe, pass their output on
+// whenever they have reduced OUTPUT_CHUNK_PAIRS pairs, so whoever consumes it
+// can start while the job still reduces.
+const size_t OUTPUT_CHUNK_PAIRS = 4096;
+
+template <class K1, class V1, class K2, class V2, class K3, class V3,
+          class Less = std::less<K2>>
+class MapReduceJob : public JobBase {
+public:
+    typedef std::pair<K1, V1> InputPair;
+    typedef std::pair<K2, V2> IntermediatePair;
+    typedef std::pair<K3, V3> OutputPair;
+
+    typedef std::vector<InputPair> InputVec;
+    typedef std::vector<IntermediatePair> IntermediateVec;
+    typedef std::vector<OutputPair> OutputVec;
+
+    // Handed to map and reduce; one per worker.
+    class Context {
+    public:
+        void emit2(K2 key, V2 value) {
+            job->emitIntermediate(thread_id, std::move(key), std::move(value));
+        }
+
+        void emit3(K3 key, V3 value) {
+            output.emplace_back(std::move(key), std::move(value));
+        }
+
+        // Emit count pairs at once, growing this worker's vectors at most
+        // once. The non-const versions move from the pairs.
+        void emit2Batch(IntermediatePair* pairs, size_t count) {
+            job->emitIntermediateBatch(thread_id, pairs, count,
+                                       [](IntermediatePair& pair) { return std::move(pair); });
+        }
+
+        void emit2Batch(const IntermediatePair* pairs, size_t count) {
+            job->emitIntermediateBatch(thread_id, pairs, count,
+                                       [](const IntermediatePair& pair) { return pair; });
+        }
+
+        // Emits convert(pairs[i]), an IntermediatePair, for every i < count.
+        template <class Source, class Convert>
+        void emit2Batch(Source* pairs, size_t count, Convert convert) {
+            job->emitIntermediateBatch(thread_id, pairs, count, convert);
+        }
+
+        void emit3Batch(OutputPair* pairs, size_t count) {
+            output.insert(output.end(), std::make_move_iterator(pairs), std::make_move_iterator(pairs + count));
+        }
+
+        void emit3Batch(const OutputPair* pairs, size_t count) {
+            output.insert(output.end(), pairs, pairs + count);
+        }
+
+        // Scratch memory that lives until the job is deleted, e.g. for
+        // objects that keys and values point at.
+        Arena& arena() { return worker_arena; }
+
+    private:
+        friend class MapReduceJob;
+
+        MapReduceJob* job;
+        int thread_id;
+        // emit3 results. An OutputSink gets them every OUTPUT_CHUNK_PAIRS
+        // during reduce, an output vector once reduce is done.
+        OutputVec output;
+        Arena worker_arena;
+    };
+
+    class Client {
+    public:
+        virtual ~Client() {}
+
+        // gets a single pair (K1, V1) and calls context.emit2 any number of
+        // times to output (K2, V2) pairs.
+        virtual void map(const K1& key, const V1& value, Context& context) const = 0;
+
+        // gets all the pairs of a single K2 key and calls context.emit3 any
+        // number of times (usually once) to output (K3, V3) pairs.
+        virtual void reduce(const IntermediateVec& pairs, Context& context) const = 0;
+
+        // optional map-side combiner, see MapReduceClient::combine.
+        virtual bool hasCombiner() const { return false; }
+        virtual IntermediatePair combine(const IntermediateVec& pairs) const
+        {
+            return pairs.front();
+        }
+
+        // optional, see MapReduceClient::reduceIsAssociative.
+        virtual bool reduceIsAssociative() const { return false; }
+
+        // optional, see MapReduceClient::keyHash.
+        virtual bool hasKeyHash() const { return false; }
+        virtual size_t keyHash(const K2&) const { return 0; }
+
+        // optional, used only by jobs started with HASH_SHUFFLE.
+        virtual bool keysEqual(const K2& a, const K2& b) const
+        {
+            Less less;
+            return !less(a, b) && !less(b, a);
+        }
+
+        // optional spill hooks, see MapReduceClient::serialize.
+        virtual bool canSpill() const { return false; }
+        virtual size_t pairBytes(const IntermediatePair&) const
+        {
+            return sizeof(IntermediatePair);
+        }
+        virtual void serialize(const IntermediatePair&, std::string&) const {}
+        virtual IntermediatePair deserialize(const char*, size_t) const
+        {
+            return IntermediatePair();
+        }
+        virtual void releasePair(const IntermediatePair&) const {}
+    };
+
+    // Where a job reads its input from: a vector, a JobPipe that other jobs
+    // write to, or an InputSource.
+    class Input {
+    public:
+        Input(const InputVec& vec) : vec(&vec), pipe(nullptr), source(nullptr) {}
+        Input(JobPipe<InputPair>& pipe) : vec(nullptr), pipe(&pipe), source(nullptr) {}
+        Input(InputSource<InputPair>& source) : vec(nullptr), pipe(nullptr), source(&source) {}
+
+    private:
+        friend class MapReduceJob;
+
+        const InputVec* vec;
+        JobPipe<InputPair>* pipe;
+        InputSource<InputPair>* source;
+    };
+
+    // Where a job writes its output to: a vector, or an OutputSink such as
+    // a JobPipe that another job reads.
+    class Output {
+    public:
+        Output(OutputVec& vec) : vec(&vec), sink(nullptr) {}
+        Output(OutputSink<OutputPair>& sink) : vec(nullptr), sink(&sink) {}
+
+    private:
+        friend class MapReduceJob;
+
+        OutputVec* vec;
+        OutputSink<OutputPair>* sink;
+    };
+
+    static JobHandle start(const Client& client, Input input, Output output,
+                           int multiThreadLevel, const JobOptions& options = JobOptions()) {
+        int numThreads = workersFor(multiThreadLevel, options);
+        auto* job = new MapReduceJob(client, input, output, numThreads, options);
+        job->launch();
+        return static_cast<JobHandle>(static_cast<JobBase*>(job));
+    }
+
+    ~MapReduceJob() override {
+        for (auto& runs : spill_runs) {
+            for (SpillRun& run : runs) {
+                for (auto& entry : run.index) {
+                    client.releasePair(entry.first);
+                }
+            }
+        }
+    }
+
+protected:
+    MapReduceJob(const Client& client, Input input, Output output,
+                 int numThreads, const JobOptions& options)
+            : JobBase(numThreads, input.vec ? static_cast<int>(input.vec->size()) : 0, options),
+              client(client),
+              input(input.vec),
+              input_pipe(input.pipe),
+              input_source(input.source),
+              output(output.vec),
+              output_sink(output.sink),
+              options(checkedOptions(client, options)),
+              contexts(numThreads),
+              input_index(0),
+              intermediate_vectors(numThreads),
+              samples(numThreads),
+              thread_budget(this->options.shuffleMode == SORT_SHUFFLE ? this->options.memoryBudget / numThreads : 0),
+              run_bytes(numThreads),
+              spilled_pairs(numThreads),
+              spill_runs(numThreads),
+              spill_files(numThreads),
+              spilled(false),
+              map_output(numThreads),
+              reduce_deques(numThreads) {
+        for (int i = 0; i < numThreads; ++i) {
+            contexts[i].job = this;
+            contexts[i].thread_id = i;
+        }
+        if (this->options.shuffleMode == HASH_SHUFFLE) {
+            hash_partitions.assign(numThreads, std::vector<IntermediateVec>(numThreads));
+        }
+        if (output_sink != nullptr) {
+            output_sink->open(numThreads);
+        }
+    }
+
+    // The options the job actually runs with, given what the client supports.
+    static JobOptions checkedOptions(const Client& client, JobOptions options) {
+        if (options.shuffleMode == HASH_SHUFFLE && !client.hasKeyHash()) {
+            options.shuffleMode = SORT_SHUFFLE;
+        }
+        if (!client.canSpill()) {
+            options.memoryBudget = 0;
+        }
+        return options;
+    }
+
+    void runWorker(int thread_id) override {
+        Context& context = contexts[thread_id];
+        ThreadStats& stats = thread_stats[thread_id];
+
+        stats.mapStart = elapsedMicros();
+        reserveVectors(context);
+        mapInput(context);
+        stats.mapEnd = elapsedMicros();
+        tracePhase(thread_id, "map", stats.mapStart, stats.mapEnd);
+
+        if (options.shuffleMode == SORT_SHUFFLE) {
+            sortRun(thread_id);
+            sampleRun(thread_id);
+        }
+        countMapOutput(thread_id);
+        stats.sortEnd = elapsedMicros();
+        tracePhase(thread_id, "sort", stats.mapEnd, stats.sortEnd);
+
+        waitBarrier(thread_id);  // Sync before shuffle/reduce
+        setStage(SHUFFLE_STAGE);
+        stats.shuffleStart = elapsedMicros();
+
+        if (spilled.load()) {
+            streamKeyRange(context);
+        } else {
+            shuffle(thread_id);
+            stats.shuffleEnd = elapsedMicros();
+            tracePhase(thread_id, "shuffle", stats.shuffleStart, stats.shuffleEnd);
+
+            waitBarrier(thread_id);  // Ensure all threads completed shuffle
+            stats.reduceStart = elapsedMicros();
+            reduce(context);
+        }
+        stats.reduceEnd = elapsedMicros();
+        tracePhase(thread_id, "reduce", stats.reduceStart, stats.reduceEnd);
+        flushOutput(context);
+    }
+
+private:
+    // A huge group whose parts are combined by several workers. The one that
+    // combines the last part reduces the combined pairs.
+    struct SplitGroup {
+        IntermediateVec combined; // one pair per part
+        std::atomic<int> pending; // parts not combined yet
+
+        explicit SplitGroup(size_t parts) : combined(parts), pending(static_cast<int>(parts)) {}
+    };
+
+    struct SplitPart {
+        int split; // index in ReduceDeque::splits, -1 for a whole group
+        int part;
+    };
+
+    // The reduce groups produced by one worker's shuffle. The owner claims
+    // batches from the front and idle workers steal from the back. Both ends
+    // share one atomic word, so every claim is a single CAS and no lock is
+    // taken.
+    struct ReduceDeque {
+        std::vector<IntermediateVec> groups;
+        std::atomic<uint64_t> bounds; // head in the low 32 bits, tail in the high 32 bits
+
+        // Parts of split groups: parts[i] is where group i belongs, empty when
+        // nothing was split.
+        std::vector<SplitPart> parts;
+        std::vector<std::unique_ptr<SplitGroup>> splits;
+
+        ReduceDeque() : bounds(0) {}
+    };
+
+    void emitIntermediate(int thread_id, K2&& key, V2&& value) {
+        thread_stats[thread_id].emittedPairs++;
+        if (options.shuffleMode == HASH_SHUFFLE) {
+            size_t reducer = client.keyHash(key) % num_threads;
+            hash_partitions[thread_id][reducer].emplace_back(std::move(key), std::move(value));
+            return;
+        }
+        IntermediateVec& vec = intermediate_vectors[thread_id];
+        vec.emplace_back(std::move(key), std::move(value));
+        if (thread_budget > 0) {
+            run_bytes[thread_id] += client.pairBytes(vec.back());
+            if (run_bytes[thread_id] > thread_budget) {
+                spillRun(thread_id);
+            }
+        }
+    }
+
+    // Appends all the pairs with a single capacity check, unless they have
+    // to be scattered or measured one at a time.
+    template <class Source, class Convert>
+    void emitIntermediateBatch(int thread_id, Source* pairs, size_t count, Convert convert) {
+        if (options.shuffleMode == HASH_SHUFFLE || thread_budget > 0) {
+            for (size_t i = 0; i < count; ++i) {
+                IntermediatePair pair = convert(pairs[i]);
+                emitIntermediate(thread_id, std::move(pair.first), std::move(pair.second));
+            }
+            return;
+        }
+
+        thread_stats[thread_id].emittedPairs += count;
+        IntermediateVec& vec = intermediate_vectors[thread_id];
+        if (vec.capacity() - vec.size() < count) {
+            vec.reserve(std::max(2 * vec.capacity(), vec.size() + count));
+        }
+        for (size_t i = 0; i < count; ++i) {
+            vec.push_back(convert(pairs[i]));
+        }
+    }
+
+    // ---------- Map ----------
+
+    // Reserves this worker's share of JobOptions::expectedIntermediatePairs
+    // and expectedOutputPairs, on the worker itself.
+    void reserveVectors(Context& context) {
+        size_t pairs = options.expectedIntermediatePairs / num_threads;
+        if (options.shuffleMode == HASH_SHUFFLE) {
+            for (IntermediateVec& partition : hash_partitions[context.thread_id]) {
+                partition.reserve(pairs / num_threads);
+            }
+        } else if (thread_budget == 0) {
+            intermediate_vectors[context.thread_id].reserve(pairs);
+        }
+        context.output.reserve(options.expectedOutputPairs / num_threads);
+    }
+
+    void mapInput(Context& context) {
+        if (input_pipe != nullptr) {
+            mapPipe(context);
+            return;
+        }
+        if (input_source != nullptr) {
+            mapSource(context);
+            return;
+        }
+
+        int batch = 1;
+        while (true) {
+            int begin = input_index.fetch_add(batch);
+            if (begin >= total_input) {
+                break;
+            }
+            int end = std::min(begin + batch, total_input);
+
+            std::chrono::nanoseconds per_item = mapBatch(context, input->data() + begin, input->data() + end);
+            batch = nextMapBatch(per_item, total_input - input_index.load(std::memory_order_relaxed));
+        }
+    }
+
+    // Maps chunks as the writing jobs pass them on. The input's size is only
+    // known once they are done, so map progress counts towards the pairs
+    // seen so far.
+    void mapPipe(Context& context) {
+        size_t batch = 1;
+        const InputPair* begin;
+        const InputPair* end;
+        size_t fresh;
+        size_t left;
+        size_t claim;
+        while (input_pipe->read(batch, begin, end, fresh, left, claim)) {
+            if (fresh > 0) {
+                addMapWork(fresh);
+            }
+            batch = nextMapBatch(mapBatch(context, begin, end), static_cast<long long>(left));
+            input_pipe->release(claim);
+        }
+    }
+
+    // Pulls chunks until the source runs dry. As with a pipe, map progress
+    // counts towards the pairs seen so far.
+    void mapSource(Context& context) {
+        std::vector<InputPair> chunk;
+        while (input_source->next(chunk)) {
+            if (!chunk.empty()) {
+                addMapWork(chunk.size());
+                mapBatch(context, chunk.data(), chunk.data() + chunk.size());
+            }
+            input_source->release(chunk);
+        }
+    }
+
+    // Maps [begin, end) and returns the time it took per pair.
+    std::chrono::nanoseconds mapBatch(Context& context, const InputPair* begin, const InputPair* end) {
+        int count = static_cast<int>(end - begin);
+        TraceScope span(this, context.thread_id, "map batch", count);
+        auto start = std::chrono::steady_clock::now();
+        for (const InputPair* pair = begin; pair != end; ++pair) {
+            client.map(pair->first, pair->second, context);
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+
+        addProgress(count);
+        thread_stats[context.thread_id].inputPairs += count;
+        return elapsed / count;
+    }
+
+    int nextMapBatch(std::chrono::nanoseconds per_item, long long remaining) const {
+        long long by_time = MAP_BATCH_TARGET.count() / std::max<long long>(1, per_item.count());
+        long long guided = remaining / (2LL * num_threads);
+        return static_cast<int>(std::max(1LL, std::min(by_time, guided)));
+    }
+
+    void sortRun(int thread_id) {
+        IntermediateVec& vec = intermediate_vectors[thread_id];
+        if (vec.size() < RADIX_MIN_PAIRS) {
+            comparisonSort(vec.begin(), vec.end());
+        } else {
+            radixSort(vec, std::integral_constant<bool, RadixKey<K2, Less>::available>());
+        }
+        if (client.hasCombiner()) {
+            combineRun(thread_id);
+        }
+    }
+
+    template <class Iterator>
+    void comparisonSort(Iterator begin, Iterator end) {
+        std::sort(begin, end, [this](const IntermediatePair& a, const IntermediatePair& b) {
+            return less(a.first, b.first);
+        });
+    }
+
+    void radixSort(IntermediateVec& vec, std::false_type) {
+        comparisonSort(vec.begin(), vec.end());
+    }
+
+    // LSD radix sort on the RadixKey, a byte per pass, skipping the bytes that
+    // all values share.
+    void radixSort(IntermediateVec& vec, std::true_type) {
+        typedef RadixKey<K2, Less> Radix;
+
+        size_t n = vec.size();
+        std::vector<size_t> counts(8 * 256);
+        for (const IntermediatePair& pair : vec) {
+            uint64_t value = Radix::get(pair.first);
+            for (int byte = 0; byte < 8; ++byte) {
+                counts[byte * 256 + ((value >> (8 * byte)) & 0xff)]++;
+            }
+        }
+
+        IntermediateVec buffer(n);
+        uint64_t first = Radix::get(vec[0].first);
+        for (int byte = 0; byte < 8; ++byte) {
+            size_t* count = &counts[byte * 256];
+            if (count[(first >> (8 * byte)) & 0xff] == n) {
+                continue;  // Every value has the same byte here
+            }
+
+            size_t offset = 0;
+            for (int digit = 0; digit < 256; ++digit) {
+                size_t digit_count = count[digit];
+                count[digit] = offset;
+                offset += digit_count;
+            }
+            for (IntermediatePair& pair : vec) {
+                buffer[count[(Radix::get(pair.first) >> (8 * byte)) & 0xff]++] = std::move(pair);
+            }
+            vec.swap(buffer);
+        }
+
+        if (!Radix::exact) {
+            for (size_t begin = 0; begin < n;) {
+                uint64_t value = Radix::get(vec[begin].first);
+                size_t end = begin + 1;
+                while (end < n && Radix::get(vec[end].first) == value) {
+                    end++;
+                }
+                if (end - begin > 1) {
+                    comparisonSort(vec.begin() + begin, vec.begin() + end);
+                }
+                begin = end;
+            }
+        }
+    }
+
+    // ---------- Combiner ----------
+    // Collapses every run of equal keys in this thread's sorted vector into the
+    // single pair returned by Client::combine, in place.
+
+    void combineRun(int thread_id) {
+        IntermediateVec& vec = intermediate_vectors[thread_id];
+
+        size_t out = 0;
+        IntermediateVec group;
+        for (size_t begin = 0; begin < vec.size();) {
+            size_t end = begin + 1;
+            while (end < vec.size() && !less(vec[begin].first, vec[end].first)) {
+                end++;
+            }
+
+            if (end - begin == 1) {
+                if (out != begin) {  // Self-move would clear keys such as std::string
+                    vec[out] = std::move(vec[begin]);
+                }
+                out++;
+            } else {
+                group.assign(std::make_move_iterator(vec.begin() + begin),
+                             std::make_move_iterator(vec.begin() + end));
+                vec[out++] = client.combine(group);
+            }
+            begin = end;
+        }
+
+        vec.resize(out);
+        if (vec.capacity() > 2 * vec.size()) {
+            vec.shrink_to_fit();
+        }
+    }
+
+    // ---------- Spilling ----------
+    // With a memoryBudget, every thread may hold memoryBudget / num_threads
+    // bytes of intermediate pairs, as measured by Client::pairBytes. Past that
+    // it sorts (and combines) its pairs and appends them to its SpillFile as
+    // one sorted run, so a thread holds one file however often it spills. The
+    // run's sparse index is what the shuffle samples and seeks by; its pairs
+    // stay alive until the job is deleted.
+
+    struct SpillRun {
+        uint64_t begin;
+        uint64_t end;
+        size_t pairs;
+        std::vector<std::pair<IntermediatePair, uint64_t>> index; // pair, offset of its record
+    };
+
+    void spillRun(int thread_id) {
+        TraceScope span(this, thread_id, "spill", static_cast<long long>(intermediate_vectors[thread_id].size()));
+        sortRun(thread_id);
+        IntermediateVec& vec = intermediate_vectors[thread_id];
+
+        std::unique_ptr<SpillFile>& file = spill_files[thread_id];
+        if (!file) {
+            file.reset(new SpillFile(options.spillDirectory));
+        }
+
+        SpillRun run;
+        run.begin = file->size();
+        std::string record;
+        for (size_t i = 0; i < vec.size(); ++i) {
+            record.clear();
+            client.serialize(vec[i], record);
+            uint64_t offset = file->append(record);
+            if (i % SPILL_INDEX_STRIDE == 0) {
+                run.index.emplace_back(std::move(vec[i]), offset);
+            } else {
+                client.releasePair(vec[i]);
+            }
+        }
+        file->flush();
+        run.end = file->size();
+        run.pairs = vec.size();
+
+        spilled_pairs[thread_id] += vec.size();
+        vec.clear();
+        run_bytes[thread_id] = 0;
+        spill_runs[thread_id].push_back(std::move(run));
+        spilled.store(true);
+    }
+
+    // Ascending cursor over one sorted run: a slice of an in-memory run, or a
+    // spilled run that is decoded a record at a time up to the first key that
+    // is not less than upper.
+    struct RunCursor {
+        IntermediatePair* next = nullptr;
+        IntermediatePair* end = nullptr;
+        std::unique_ptr<SpillReader> reader;
+        const K2* upper = nullptr;
+        IntermediatePair decoded;
+    };
+
+    void readCursor(RunCursor& cursor) {
+        const char* data;
+        uint32_t size;
+        if (cursor.reader->next(data, size)) {
+            cursor.decoded = client.deserialize(data, size);
+            if (!cursor.upper || less(cursor.decoded.first, *cursor.upper)) {
+                cursor.next = &cursor.decoded;
+                cursor.end = cursor.next + 1;
+                return;
+            }
+            client.releasePair(cursor.decoded);
+        }
+        cursor.next = cursor.end = nullptr;
+        cursor.reader.reset();
+    }
+
+    void advanceCursor(RunCursor& cursor) {
+        if (++cursor.next == cursor.end && cursor.reader) {
+            readCursor(cursor);
+        }
+    }
+
+    // Positions cursor on the first pair of run whose key is not less than
+    // lower, by seeking to the closest index entry below it.
+    void openSpilledRun(RunCursor& cursor, int run_thread, const SpillRun& run, const K2* lower, const K2* upper) {
+        uint64_t offset = run.begin;
+        if (lower) {
+            auto it = std::lower_bound(run.index.begin(), run.index.end(), *lower,
+                                       [this](const std::pair<IntermediatePair, uint64_t>& entry, const K2& key) {
+                                           return less(entry.first.first, key);
+                                       });
+            if (it != run.index.begin()) {
+                offset = std::prev(it)->second;
+            }
+        }
+
+        cursor.reader.reset(new SpillReader(*spill_files[run_thread], offset, run.end));
+        cursor.upper = upper;
+        readCursor(cursor);
+        while (lower && cursor.next != cursor.end && less(cursor.next->first, *lower)) {
+            client.releasePair(*cursor.next);
+            readCursor(cursor);
+        }
+    }
+
+    // ---------- Shuffle ----------
+    // The shuffle is a parallel sample sort: every thread takes num_threads
+    // regular samples of each of its sorted runs, the merged samples pick
+    // num_threads - 1 splitters, and thread i merges only the keys in
+    // [splitter[i-1], splitter[i]) out of every run, spilled runs included.
+    // Equal keys always land in the same range, so groups never straddle
+    // threads. With HASH_SHUFFLE, emitIntermediate already scattered the
+    // pairs by key hash and thread i only groups hash partition i.
+
+    // A sample stands for the `pairs` pairs of its run from it up to the
+    // next sample, so a huge spilled run weighs more than a short tail.
+    struct Sample {
+        const IntermediatePair* pair;
+        size_t pairs;
+    };
+
+    void sampleRun(int thread_id) {
+        const IntermediateVec& vec = intermediate_vectors[thread_id];
+        size_t count = std::min(vec.size(), static_cast<size_t>(num_threads));
+        for (size_t i = 0; i < count; ++i) {
+            size_t begin = i * vec.size() / count;
+            size_t end = (i + 1) * vec.size() / count;
+            samples[thread_id].push_back(Sample{&vec[begin], end - begin});
+        }
+
+        // Index entries are SPILL_INDEX_STRIDE pairs apart
+        for (const SpillRun& run : spill_runs[thread_id]) {
+            count = std::min(run.index.size(), static_cast<size_t>(num_threads));
+            for (size_t i = 0; i < count; ++i) {
+                size_t entry = i * run.index.size() / count;
+                size_t begin = entry * SPILL_INDEX_STRIDE;
+                size_t end = std::min((i + 1) * run.index.size() / count * SPILL_INDEX_STRIDE, run.pairs);
+                samples[thread_id].push_back(Sample{&run.index[entry].first, end - begin});
+            }
+        }
+    }
+
+    // Index of the first pair of vec whose key belongs to partition `part`.
+    size_t partitionStart(const IntermediateVec& vec,
+                          const std::vector<const IntermediatePair*>& splitters, int part) const {
+        if (part == 0) {
+            return 0;
+        }
+        if (static_cast<size_t>(part) > splitters.size()) {
+            return vec.size();
+        }
+        const K2& splitter = splitters[part - 1]->first;
+        auto it = std::lower_bound(vec.begin(), vec.end(), splitter,
+                                   [this](const IntermediatePair& p, const K2& key) {
+                                       return less(p.first, key);
+                                   });
+        return static_cast<size_t>(it - vec.begin());
+    }
+
+    // Opens a cursor on this thread's key range of every sorted run. Cursors
+    // point into themselves, so they are never moved once open.
+    // Spilled runs are read up to a copy of the next thread's splitter, made
+    // through serialize and deserialize into upper_bound, since the original
+    // may be reduced (and released) by another thread meanwhile. The caller
+    // releases upper_bound once the cursors are exhausted.
+    void openKeyRange(int thread_id, std::vector<RunCursor>& cursors,
+                      IntermediatePair* upper_bound) {
+        // Every thread derives the same splitters from the same samples, which
+        // saves a barrier compared to publishing them from a single thread.
+        std::vector<Sample> all_samples;
+        size_t sampled_pairs = 0;
+        for (const auto& s : samples) {
+            all_samples.insert(all_samples.end(), s.begin(), s.end());
+            for (const Sample& sample : s) {
+                sampled_pairs += sample.pairs;
+            }
+        }
+        std::sort(all_samples.begin(), all_samples.end(),
+                  [this](const Sample& a, const Sample& b) {
+                      return less(a.pair->first, b.pair->first);
+                  });
+
+        // Splitter i is the first sample with i / num_threads of the pairs
+        // before it
+        std::vector<const IntermediatePair*> splitters;
+        if (!all_samples.empty()) {
+            size_t sample = 0;
+            size_t before = 0;
+            for (int i = 1; i < num_threads; ++i) {
+                size_t target = i * sampled_pairs / num_threads;
+                while (before < target && sample + 1 < all_samples.size()) {
+                    before += all_samples[sample++].pairs;
+                }
+                splitters.push_back(all_samples[sample].pair);
+            }
+        }
+
+        size_t runs = intermediate_vectors.size();
+        for (const auto& spilled_runs : spill_runs) {
+            runs += spilled_runs.size();
+        }
+        cursors.reserve(runs);
+
+        for (IntermediateVec& vec : intermediate_vectors) {
+            cursors.emplace_back();
+            cursors.back().next = vec.data() + partitionStart(vec, splitters, thread_id);
+            cursors.back().end = vec.data() + partitionStart(vec, splitters, thread_id + 1);
+        }
+
+        if (runs == intermediate_vectors.size() || (splitters.empty() && thread_id > 0)) {
+            return;  // No spilled runs, or nothing in this range
+        }
+        const K2* lower = thread_id > 0 ? &splitters[thread_id - 1]->first : nullptr;
+        const K2* upper = nullptr;
+        if (thread_id < num_threads - 1) {
+            std::string record;
+            client.serialize(*splitters[thread_id], record);
+            *upper_bound = client.deserialize(record.data(), record.size());
+            upper = &upper_bound->first;
+        }
+        for (int run_thread = 0; run_thread < num_threads; ++run_thread) {
+            for (const SpillRun& run : spill_runs[run_thread]) {
+                cursors.emplace_back();
+                openSpilledRun(cursors.back(), run_thread, run, lower, upper);
+            }
+        }
+    }
+
+    // Merges the cursors into groups of equal keys, in ascending key order,
+    // and hands every group to sink, which must leave it empty. Equal keys
+    // come out in run order, as a stable merge would.
+    template <class Sink>
+    void mergeRuns(std::vector<RunCursor>& cursors, Sink sink) {
+        auto beats = [this, &cursors](size_t a, size_t b) {
+            const RunCursor& x = cursors[a];
+            const RunCursor& y = cursors[b];
+            if (x.next == x.end || y.next == y.end) {
+                return y.next == y.end && (x.next != x.end || a < b);
+            }
+            if (less(x.next->first, y.next->first)) {
+                return true;
+            }
+            return !less(y.next->first, x.next->first) && a < b;
+        };
+        auto tree = makeLoserTree(cursors.size(), beats);
+
+        IntermediateVec group;
+        while (!cursors.empty()) {
+            RunCursor& smallest = cursors[tree.winner()];
+            if (smallest.next == smallest.end) {
+                break;  // All runs are exhausted
+            }
+
+            // A copy, since moving the pairs into the group may clear the original
+            K2 key = smallest.next->first;
+            while (true) {
+                RunCursor& cursor = cursors[tree.winner()];
+                if (cursor.next == cursor.end || less(key, cursor.next->first)) {
+                    break;
+                }
+                group.push_back(std::move(*cursor.next));
+                advanceCursor(cursor);
+                tree.replay();
+            }
+            sink(group);
+        }
+    }
+
+    // Merges this thread's key range out of every sorted run into groups.
+    std::vector<IntermediateVec> mergeKeyRange(int thread_id) {
+        std::vector<RunCursor> cursors;
+        openKeyRange(thread_id, cursors, nullptr);  // Nothing spilled
+
+        // Other threads binary-search every run until they have their slices,
+        // only then may pairs be moved out of ours.
+        waitBarrier(thread_id);
+
+        std::vector<IntermediateVec> groups;
+        mergeRuns(cursors, [&groups](IntermediateVec& group) {
+            groups.push_back(std::move(group));
+            group.clear();
+        });
+        return groups;
+    }
+
+    // Used instead of shuffle and reduce once any thread spilled: the merged
+    // groups go straight to reduce rather than being collected, so the job
+    // never holds all of its pairs in memory. As the number of groups is not
+    // known up front, reduce progress counts pairs.
+    void streamKeyRange(Context& context) {
+        int thread_id = context.thread_id;
+        addReduceWork(spilled_pairs[thread_id] + intermediate_vectors[thread_id].size());
+
+        std::vector<RunCursor> cursors;
+        IntermediatePair upper_bound;
+        openKeyRange(thread_id, cursors, &upper_bound);
+
+        ThreadStats& stats = thread_stats[thread_id];
+        stats.shuffleEnd = elapsedMicros();
+        tracePhase(thread_id, "shuffle", stats.shuffleStart, stats.shuffleEnd);
+
+        // As in mergeKeyRange. This also makes sure the reduce work is
+        // complete before anyone reports REDUCE_STAGE.
+        waitBarrier(thread_id);
+        setStage(REDUCE_STAGE);
+        stats.reduceStart = elapsedMicros();
+
+        mergeRuns(cursors, [this, &context](IntermediateVec& group) {
+            countGroup(context.thread_id, group.size());
+            TraceScope span(this, context.thread_id, "reduce group", static_cast<long long>(group.size()));
+            client.reduce(group, context);  // calls emit3 internally
+            addProgress(group.size());
+            group.clear();
+            passOutput(context);
+        });
+
+        if (thread_id < num_threads - 1) {
+            client.releasePair(upper_bound);
+        }
+    }
+
+    // Groups the pairs that every mapper scattered into this thread's hash
+    // partition, in a single pass and without comparing keys for order.
+    std::vector<IntermediateVec> groupHashPartition(int thread_id) {
+        const Client& c = client;
+        auto hash = [&c](const K2& key) { return c.keyHash(key); };
+        auto equal = [&c](const K2& a, const K2& b) { return c.keysEqual(a, b); };
+        std::unordered_map<K2, size_t, decltype(hash), decltype(equal)> group_of(16, hash, equal);
+
+        std::vector<IntermediateVec> groups;
+        for (auto& partitions : hash_partitions) {
+            IntermediateVec& partition = partitions[thread_id];
+            for (IntermediatePair& pair : partition) {
+                auto it = group_of.find(pair.first);
+                if (it == group_of.end()) {
+                    it = group_of.emplace(pair.first, groups.size()).first;
+                    groups.emplace_back();
+                }
+                groups[it->second].push_back(std::move(pair));
+            }
+        }
+        return groups;
+    }
+
+    void shuffle(int thread_id) {
+        std::vector<IntermediateVec> groups = options.shuffleMode == HASH_SHUFFLE
+                ? groupHashPartition(thread_id)
+                : mergeKeyRange(thread_id);
+
+        ReduceDeque& deque = reduce_deques[thread_id];
+        if (options.shuffleMode == HASH_SHUFFLE && client.hasCombiner() && client.reduceIsAssociative()
+            && num_threads > 1) {
+            splitHugeGroups(thread_id, groups, deque);
+        }
+        deque.bounds.store(static_cast<uint64_t>(groups.size()) << 32);
+        deque.groups = std::move(groups);
+
+        // A split group is one unit of work per part, and one for its reduce
+        addReduceWork(deque.groups.size() + deque.splits.size());
+    }
+
+    // ---------- Splitting ----------
+
+    // Records how many pairs this thread's map left, once they are final.
+    void countMapOutput(int thread_id) {
+        size_t pairs = intermediate_vectors[thread_id].size();
+        if (options.shuffleMode == HASH_SHUFFLE) {
+            for (const IntermediateVec& partition : hash_partitions[thread_id]) {
+                pairs += partition.size();
+            }
+        }
+        map_output[thread_id] = pairs;
+    }
+
+    // Cuts every group of more than split_pairs into parts of split_pairs,
+    // which go to the front of the deque so that the owner starts on them
+    // and thieves take the rest.
+    void splitHugeGroups(int thread_id, std::vector<IntermediateVec>& groups, ReduceDeque& deque) {
+        size_t total = 0;
+        for (size_t pairs : map_output) {
+            total += pairs;
+        }
+        size_t split_pairs = std::max(SPLIT_MIN_PAIRS, total / (4 * num_threads));
+
+        std::vector<IntermediateVec> parts;
+        std::vector<IntermediateVec> whole;
+        for (IntermediateVec& group : groups) {
+            if (group.size() <= split_pairs) {
+                whole.push_back(std::move(group));
+                continue;
+            }
+
+            countGroup(thread_id, group.size());
+            thread_stats[thread_id].splitGroups++;
+            size_t count = (group.size() + split_pairs - 1) / split_pairs;
+            int split = static_cast<int>(deque.splits.size());
+            deque.splits.emplace_back(new SplitGroup(count));
+            for (size_t part = 0; part < count; ++part) {
+                auto begin = group.begin() + part * group.size() / count;
+                auto end = group.begin() + (part + 1) * group.size() / count;
+                parts.emplace_back(std::make_move_iterator(begin), std::make_move_iterator(end));
+                deque.parts.push_back(SplitPart{split, static_cast<int>(part)});
+            }
+        }
+        if (deque.splits.empty()) {
+            groups = std::move(whole);
+            return;
+        }
+
+        deque.parts.resize(parts.size() + whole.size(), SplitPart{-1, 0});
+        parts.insert(parts.end(), std::make_move_iterator(whole.begin()), std::make_move_iterator(whole.end()));
+        groups = std::move(parts);
+    }
+
+    void reducePart(Context& context, ReduceDeque& deque, IntermediateVec& pairs, SplitPart part) {
+        SplitGroup& split = *deque.splits[part.split];
+        {
+            TraceScope span(this, context.thread_id, "combine part", static_cast<long long>(pairs.size()));
+            split.combined[part.part] = client.combine(pairs);
+        }
+        addProgress(1);
+
+        if (split.pending.fetch_sub(1) == 1) {
+            TraceScope span(this, context.thread_id, "reduce group", static_cast<long long>(split.combined.size()));
+            client.reduce(split.combined, context);  // calls emit3 internally
+            IntermediateVec().swap(split.combined);
+            addProgress(1);
+        }
+    }
+
+    // ---------- Reduce ----------
+
+    // Claims a batch of groups [begin, end) from the front or the back of
+    // deque. Returns false once the deque is empty.
+    static bool claimGroups(ReduceDeque& deque, bool front, uint32_t& begin, uint32_t& end) {
+        uint64_t bounds = deque.bounds.load();
+        while (true) {
+            uint32_t head = static_cast<uint32_t>(bounds);
+            uint32_t tail = static_cast<uint32_t>(bounds >> 32);
+            if (head >= tail) {
+                return false;
+            }
+
+            uint32_t count = std::min(REDUCE_MAX_BATCH, std::max(1u, (tail - head) / 2));
+            if (front) {
+                begin = head;
+                end = head + count;
+            } else {
+                begin = tail - count;
+                end = tail;
+            }
+
+            uint64_t claimed = front ? (static_cast<uint64_t>(tail) << 32) | end
+                                     : (static_cast<uint64_t>(begin) << 32) | head;
+            if (deque.bounds.compare_exchange_weak(bounds, claimed)) {
+                return true;
+            }
+        }
+    }
+
+    void reduceGroups(Context& context, ReduceDeque& deque, bool front) {
+        uint32_t begin;
+        uint32_t end;
+        while (claimGroups(deque, front, begin, end)) {
+            for (uint32_t i = begin; i < end; ++i) {
+                if (!deque.parts.empty() && deque.parts[i].split >= 0) {
+                    reducePart(context, deque, deque.groups[i], deque.parts[i]);
+                    IntermediateVec().swap(deque.groups[i]);
+                    continue;
+                }
+                countGroup(context.thread_id, deque.groups[i].size());
+                {
+                    TraceScope span(this, context.thread_id, "reduce group",
+                                    static_cast<long long>(deque.groups[i].size()));
+                    client.reduce(deque.groups[i], context);  // calls emit3 internally
+                }
+                IntermediateVec().swap(deque.groups[i]);
+                addProgress(1);
+            }
+            passOutput(context);
+        }
+    }
+
+    void reduce(Context& context) {
+        // Every pair now lives in some group, release this thread's sorted run
+        // and hash partitions
+        IntermediateVec().swap(intermediate_vectors[context.thread_id]);
+        for (auto& partitions : hash_partitions) {
+            IntermediateVec().swap(partitions[context.thread_id]);
+        }
+
+        setStage(REDUCE_STAGE);
+
+        // Drain our own groups first, then steal from the others. Nothing is
+        // added to a deque during reduce, so one pass over the victims is
+        // enough.
+        reduceGroups(context, reduce_deques[context.thread_id], true);
+        for (int i = 1; i < num_threads; ++i) {
+            int victim = (context.thread_id + i) % num_threads;
+            reduceGroups(context, reduce_deques[victim], false);
+        }
+    }
+
+    // With an OutputSink, passes what this worker reduced so far on once it
+    // makes a chunk.
+    void passOutput(Context& context) {
+        if (output_sink != nullptr && context.output.size() >= OUTPUT_CHUNK_PAIRS) {
+            thread_stats[context.thread_id].outputPairs += context.output.size();
+            output_sink->write(context.thread_id, context.output);
+            context.output.clear();
+        }
+    }
+
+    void flushOutput(Context& context) {
+        thread_stats[context.thread_id].outputPairs += context.output.size();
+
+        if (output_sink != nullptr) {
+            if (!context.output.empty()) {
+                output_sink->write(context.thread_id, context.output);
+            }
+            OutputVec().swap(context.output);
+            output_sink->close(context.thread_id);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(output_mutex);
+        output->insert(output->end(), std::make_move_iterator(context.output.begin()),
+                       std::make_move_iterator(context.output.end()));
+        OutputVec().swap(context.output);
+    }
+
+    const Client& client;
+    const InputVec* input;           // null when reading input_pipe or input_source
+    JobPipe<InputPair>* input_pipe;
+    InputSource<InputPair>* input_source;
+    OutputVec* output;               // null when writing output_sink
+    OutputSink<OutputPair>* output_sink;
+    const JobOptions options;
+    Less less;
+
+    std::vector<Context> contexts;
+    std::mutex output_mutex;
+
+    std::atomic<int> input_index;
+    std::vector<IntermediateVec> intermediate_vectors;
+    std::vector<std::vector<Sample>> samples; // regular samples of each thread's sorted runs
+
+    const size_t thread_budget; // bytes, 0 when the job never spills
+    std::vector<size_t> run_bytes;
+    std::vector<size_t> spilled_pairs;
+    std::vector<std::vector<SpillRun>> spill_runs;
+    std::vector<std::unique_ptr<SpillFile>> spill_files; // one per thread, created on its first spill
+    std::atomic<bool> spilled;
+    std::vector<std::vector<IntermediateVec>> hash_partitions; // [mapper][reducer], HASH_SHUFFLE only
+
+    std::vector<size_t> map_output; // pairs each thread's map left, after combining
+    std::vector<ReduceDeque> reduce_deques;
+};
+
+#endif // MAPREDUCEJOB_H
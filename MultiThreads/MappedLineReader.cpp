@@ -0,0 +1,108 @@
+#include "MappedLineReader.h"
+#include "SystemError.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedLineReader::MappedLineReader(const char* path, size_t chunkBytes)
+        : data(nullptr),
+          file_size(0),
+          chunk_bytes(std::max<size_t>(chunkBytes, 1)),
+          next_chunk(0) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        systemError("failed to open input file");
+    }
+    struct stat status;
+    if (fstat(fd, &status) < 0) {
+        systemError("failed to stat input file");
+    }
+    file_size = static_cast<uint64_t>(status.st_size);
+
+    // mmap refuses empty mappings, and there is nothing to read anyway
+    if (file_size > 0) {
+        void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            systemError("failed to map input file");
+        }
+        madvise(mapping, file_size, MADV_SEQUENTIAL);
+        data = static_cast<const char*>(mapping);
+    }
+    close(fd);
+}
+
+MappedLineReader::~MappedLineReader() {
+    if (data != nullptr) {
+        munmap(const_cast<char*>(data), file_size);
+    }
+}
+
+// A line belongs to the chunk it starts in: the chunk [begin, end) skips the
+// line running into it from before, and finishes the last line it starts
+// even if that runs past end.
+bool MappedLineReader::next(std::vector<std::pair<uint64_t, std::string>>& lines) {
+    uint64_t begin = next_chunk.fetch_add(chunk_bytes);
+    if (begin >= file_size) {
+        return false;
+    }
+    uint64_t end = std::min(begin + chunk_bytes, file_size);
+
+    uint64_t line = begin;
+    if (line > 0 && data[line - 1] != '\n') {
+        const void* newline = std::memchr(data + line, '\n', end - line);
+        line = newline ? static_cast<const char*>(newline) - data + 1 : end;
+    }
+
+    // Assigning into the pairs already there reuses their strings' memory
+    size_t count = 0;
+    while (line < end) {
+        const void* newline = std::memchr(data + line, '\n', file_size - line);
+        uint64_t line_end = newline ? static_cast<const char*>(newline) - data : file_size;
+        uint64_t text_end = line_end > line && data[line_end - 1] == '\r' ? line_end - 1 : line_end;
+
+        if (count == lines.size()) {
+            lines.emplace_back();
+        }
+        lines[count].first = line;
+        lines[count].second.assign(data + line, text_end - line);
+        count++;
+        line = line_end + 1;
+    }
+    lines.resize(count);
+
+    // Every line starting in the chunk is copied out, so its whole pages can
+    // go. Pages shared with a neighbouring chunk are read from the file again
+    // if that chunk still needs them.
+    uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    uint64_t first_page = (begin + page - 1) / page * page;
+    uint64_t last_page = end / page * page;
+    if (first_page < last_page) {
+        madvise(const_cast<char*>(data) + first_page, last_page - first_page, MADV_DONTNEED);
+    }
+    return true;
+}
+
+bool PointerLineSource::next(std::vector<InputPair>& pairs) {
+    std::vector<std::pair<uint64_t, std::string>> lines;
+    if (!reader.next(lines)) {
+        return false;
+    }
+    pairs.clear();
+    pairs.reserve(lines.size());
+    for (auto& line : lines) {
+        pairs.emplace_back(new LineOffset(line.first), new LineText(std::move(line.second)));
+    }
+    return true;
+}
+
+void PointerLineSource::release(std::vector<InputPair>& pairs) {
+    for (const InputPair& pair : pairs) {
+        delete pair.first;
+        delete pair.second;
+    }
+    pairs.clear();
+}
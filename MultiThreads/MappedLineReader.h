@@ -0,0 +1,71 @@
+#ifndef MAPPEDLINEREADER_H
+#define MAPPEDLINEREADER_H
+#include "InputSource.h"
+#include "MapReduceClient.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+// Reads a text file through mmap as (byte offset, line) pairs, without the
+// trailing "\n" or "\r\n". Workers claim chunkBytes of the file at a time and
+// take the lines starting in their chunk, so chunks split at newlines without
+// the workers coordinating. Pages are dropped once their lines are read, so
+// memory does not grow with the file.
+class MappedLineReader : public InputSource<std::pair<uint64_t, std::string>> {
+public:
+    explicit MappedLineReader(const char* path, size_t chunkBytes = 1 << 20);
+    ~MappedLineReader() override;
+    MappedLineReader(const MappedLineReader&) = delete;
+    MappedLineReader& operator=(const MappedLineReader&) = delete;
+
+    bool next(std::vector<std::pair<uint64_t, std::string>>& lines) override;
+
+    uint64_t size() const { return file_size; }
+
+private:
+    const char* data;
+    uint64_t file_size;
+    const size_t chunk_bytes;
+    std::atomic<uint64_t> next_chunk; // first byte not yet claimed
+};
+
+// ---------- PointerLineSource ----------
+// The key and value PointerLineSource hands map: a line's byte offset, and
+// the line itself.
+class LineOffset : public K1 {
+public:
+    explicit LineOffset(uint64_t offset) : offset(offset) {}
+    bool operator<(const K1& other) const override {
+        return offset < static_cast<const LineOffset&>(other).offset;
+    }
+
+    uint64_t offset;
+};
+
+class LineText : public V1 {
+public:
+    explicit LineText(std::string text) : text(std::move(text)) {}
+
+    std::string text;
+};
+
+// MappedLineReader for the pointer API. Every line reaches map as a
+// LineOffset key and a LineText value, which the source creates when the
+// chunk is read and deletes once it is mapped, so map must not keep them.
+class PointerLineSource : public InputSource<InputPair> {
+public:
+    explicit PointerLineSource(const char* path, size_t chunkBytes = 1 << 20) : reader(path, chunkBytes) {}
+
+    bool next(std::vector<InputPair>& pairs) override;
+    void release(std::vector<InputPair>& pairs) override;
+
+    uint64_t size() const { return reader.size(); }
+
+private:
+    MappedLineReader reader;
+};
+
+#endif // MAPPEDLINEREADER_H
@@ -0,0 +1,32 @@
+#include "OutputSink.h"
+#include "SystemError.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+OutputFile::OutputFile(const char* path)
+        : fd(open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) {
+    if (fd < 0) {
+        systemError("failed to create output file");
+    }
+}
+
+OutputFile::~OutputFile() {
+    close(fd);
+}
+
+void OutputFile::append(const std::string& data) {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            systemError("failed to write output file");
+        }
+        done += static_cast<size_t>(n);
+    }
+}
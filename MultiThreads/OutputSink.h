@@ -0,0 +1,181 @@
+#ifndef OUTPUTSINK_H
+#define OUTPUTSINK_H
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Where a job's workers put their output pairs, chunk by chunk while they
+// reduce, instead of one vector filled under a lock once reduce is over.
+// Every worker writes on its own: calls for different workers come at the
+// same time, calls for the same worker never do. A sink takes the output of
+// one job, unless it says otherwise.
+template <class Pair>
+class OutputSink {
+public:
+    virtual ~OutputSink() {}
+
+    // Called once, before any write, with the number of workers writing.
+    virtual void open(int /* workers */) {}
+
+    // Takes a chunk reduced by worker. The pairs may be moved out; the job
+    // clears the vector afterwards.
+    virtual void write(int worker, std::vector<Pair>& pairs) = 0;
+
+    // Called once per worker, after its last write.
+    virtual void close(int /* worker */) {}
+};
+
+// Keeps every worker's pairs in a vector of its own, so writing takes no
+// lock. The first chunk of every worker is kept as is, the rest are moved.
+template <class Pair>
+class VectorSink : public OutputSink<Pair> {
+public:
+    void open(int workers) override { parts.resize(workers); }
+
+    void write(int worker, std::vector<Pair>& pairs) override {
+        std::vector<Pair>& part = parts[worker];
+        if (part.empty()) {
+            part.swap(pairs);
+            return;
+        }
+        part.insert(part.end(), std::make_move_iterator(pairs.begin()), std::make_move_iterator(pairs.end()));
+    }
+
+    // The pairs of each worker, once the job is done.
+    const std::vector<std::vector<Pair>>& workers() const { return parts; }
+
+    // Moves all the pairs into one vector, once the job is done.
+    std::vector<Pair> collect() {
+        size_t total = 0;
+        for (const std::vector<Pair>& part : parts) {
+            total += part.size();
+        }
+        std::vector<Pair> all;
+        all.reserve(total);
+        for (std::vector<Pair>& part : parts) {
+            all.insert(all.end(), std::make_move_iterator(part.begin()), std::make_move_iterator(part.end()));
+            std::vector<Pair>().swap(part);
+        }
+        return all;
+    }
+
+private:
+    std::vector<std::vector<Pair>> parts;
+};
+
+// Hands every pair to a function as soon as its chunk is written, while the
+// job is still reducing. The function is called from all the workers at
+// once, so it must be thread safe.
+template <class Pair>
+class CallbackSink : public OutputSink<Pair> {
+public:
+    explicit CallbackSink(std::function<void(Pair&&)> callback) : callback(std::move(callback)) {}
+
+    void write(int, std::vector<Pair>& pairs) override {
+        for (Pair& pair : pairs) {
+            callback(std::move(pair));
+        }
+    }
+
+private:
+    std::function<void(Pair&&)> callback;
+};
+
+// ---------- FileSink ----------
+
+// The untyped part of FileSink: a file that whole buffers are appended to,
+// from any thread.
+class OutputFile {
+public:
+    explicit OutputFile(const char* path);
+    ~OutputFile();
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    // Writes data in one piece, so buffers of different threads never mix.
+    void append(const std::string& data);
+
+private:
+    int fd;
+    std::mutex mutex;
+};
+
+inline void appendText(std::string& out, const std::string& text) {
+    out += text;
+}
+
+template <class T>
+void appendText(std::string& out, const T& value, std::true_type /* arithmetic */) {
+    out += std::to_string(value);
+}
+
+template <class T>
+void appendText(std::string& out, const T& value, std::false_type) {
+    std::ostringstream text;
+    text << value;
+    out += text.str();
+}
+
+template <class T>
+void appendText(std::string& out, const T& value) {
+    appendText(out, value, std::is_arithmetic<T>());
+}
+
+// Appends "key\tvalue\n", using operator<< for types that are neither
+// strings nor numbers.
+template <class Pair>
+void appendTabSeparated(const Pair& pair, std::string& out) {
+    static_assert(!std::is_pointer<typename Pair::first_type>::value &&
+                  !std::is_pointer<typename Pair::second_type>::value,
+                  "pairs of pointers need an explicit FileSink::Format");
+    appendText(out, pair.first);
+    out += '\t';
+    appendText(out, pair.second);
+    out += '\n';
+}
+
+// Writes the pairs to a file as text, format appending each one to a buffer.
+// Every worker fills a buffer of its own and writes it out whenever it holds
+// bufferBytes, so lines of different workers interleave but never tear. The
+// default format would print pointers as addresses, so pairs of pointers,
+// such as the pointer API's OutputPair, must be given a format.
+template <class Pair>
+class FileSink : public OutputSink<Pair> {
+public:
+    typedef std::function<void(const Pair&, std::string&)> Format;
+
+    explicit FileSink(const char* path, Format format = appendTabSeparated<Pair>, size_t bufferBytes = 1 << 20)
+            : file(path), format(std::move(format)), buffer_bytes(bufferBytes) {}
+
+    void open(int workers) override { buffers.resize(workers); }
+
+    void write(int worker, std::vector<Pair>& pairs) override {
+        std::string& buffer = buffers[worker];
+        for (const Pair& pair : pairs) {
+            format(pair, buffer);
+            if (buffer.size() >= buffer_bytes) {
+                file.append(buffer);
+                buffer.clear();
+            }
+        }
+    }
+
+    void close(int worker) override {
+        file.append(buffers[worker]);
+        std::string().swap(buffers[worker]);
+    }
+
+private:
+    OutputFile file;
+    Format format;
+    const size_t buffer_bytes;
+    std::vector<std::string> buffers; // one per worker
+};
+
+#endif // OUTPUTSINK_H
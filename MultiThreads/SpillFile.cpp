@@ -0,0 +1,106 @@
+#include "SpillFile.h"
+#include "SystemError.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+static const size_t WRITE_BUFFER_SIZE = 1 << 20;
+static const size_t READ_BUFFER_SIZE = 256 * 1024;
+
+SpillFile::SpillFile(const char* directory)
+        : fd(-1),
+          written(0) {
+    if (directory == nullptr) {
+        directory = std::getenv("TMPDIR");
+    }
+    std::string path = std::string(directory ? directory : "/tmp") + "/mapreduce-spill-XXXXXX";
+
+    fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        systemError("failed to create spill file");
+    }
+    unlink(path.c_str());
+}
+
+SpillFile::~SpillFile() {
+    close(fd);
+}
+
+uint64_t SpillFile::append(const std::string& record) {
+    uint64_t offset = size();
+    auto length = static_cast<uint32_t>(record.size());
+    buffer.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    buffer.append(record);
+    if (buffer.size() >= WRITE_BUFFER_SIZE) {
+        flush();
+    }
+    return offset;
+}
+
+void SpillFile::flush() {
+    size_t done = 0;
+    while (done < buffer.size()) {
+        ssize_t n = pwrite(fd, buffer.data() + done, buffer.size() - done,
+                           static_cast<off_t>(written + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {  // A write that makes no progress would loop forever
+            systemError("failed to write spill file");
+        }
+        done += static_cast<size_t>(n);
+    }
+    written += buffer.size();
+    buffer.clear();
+}
+
+SpillReader::SpillReader(const SpillFile& file, uint64_t offset, uint64_t end)
+        : file(file),
+          offset(offset),
+          end(end),
+          position(0) {}
+
+bool SpillReader::next(const char*& data, uint32_t& size) {
+    uint32_t length = 0;
+    while (true) {
+        size_t available = buffer.size() - position;
+        if (available >= sizeof(length)) {
+            std::memcpy(&length, buffer.data() + position, sizeof(length));
+            if (available >= sizeof(length) + length) {
+                break;
+            }
+        }
+
+        // Keep the partial record and read more after it
+        buffer.erase(0, position);
+        offset += position;
+        position = 0;
+
+        size_t kept = buffer.size();
+        size_t wanted = std::max(READ_BUFFER_SIZE, sizeof(length) + length);
+        wanted = static_cast<size_t>(std::min<uint64_t>(wanted, end - (offset + kept)));
+        if (wanted == 0) {
+            return false;
+        }
+        buffer.resize(kept + wanted);
+        ssize_t n;
+        do {
+            n = pread(file.fd, &buffer[kept], wanted, static_cast<off_t>(offset + kept));
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            systemError("failed to read spill file");
+        }
+        buffer.resize(kept + static_cast<size_t>(n));
+        if (n == 0) {
+            return false;
+        }
+    }
+
+    data = buffer.data() + position + sizeof(length);
+    size = length;
+    position += sizeof(length) + length;
+    return true;
+}
@@ -0,0 +1,51 @@
+#ifndef SPILLFILE_H
+#define SPILLFILE_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Anonymous temporary file holding length-prefixed records, used to spill
+// sorted runs of intermediate pairs one after another. The file is unlinked
+// as soon as it is created, so it disappears with the object (or the
+// process).
+class SpillFile {
+public:
+    // directory may be nullptr for $TMPDIR, or /tmp if that is not set.
+    explicit SpillFile(const char* directory);
+    ~SpillFile();
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+
+    // Appends one record, returns its offset. Records are buffered until flush.
+    uint64_t append(const std::string& record);
+    void flush();
+
+    uint64_t size() const { return written + buffer.size(); }
+
+private:
+    friend class SpillReader;
+
+    int fd;
+    uint64_t written;
+    std::string buffer;
+};
+
+// Sequential reader over the records of a flushed SpillFile in [offset, end).
+// Several readers may read the same file at the same time.
+class SpillReader {
+public:
+    SpillReader(const SpillFile& file, uint64_t offset, uint64_t end);
+
+    // Points data/size at the next record, valid until the next call.
+    // Returns false at end.
+    bool next(const char*& data, uint32_t& size);
+
+private:
+    const SpillFile& file;
+    uint64_t offset;      // file offset of buffer[0]
+    const uint64_t end;
+    std::string buffer;
+    size_t position;      // first unread byte of buffer
+};
+
+#endif // SPILLFILE_H
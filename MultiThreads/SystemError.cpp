@@ -0,0 +1,9 @@
+#include "SystemError.h"
+
+#include <cstdlib>
+#include <iostream>
+
+void systemError(const char* what) {
+    std::cout << "system error: " << what << std::endl;
+    exit(1);
+}
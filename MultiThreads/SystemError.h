@@ -0,0 +1,8 @@
+#ifndef SYSTEMERROR_H
+#define SYSTEMERROR_H
+
+// Prints "system error: " and what to stdout and exits with status 1, for
+// failed system calls the framework cannot recover from.
+[[noreturn]] void systemError(const char* what);
+
+#endif // SYSTEMERROR_H
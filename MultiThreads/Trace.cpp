@@ -0,0 +1,36 @@
+#include "Trace.h"
+
+#include <fstream>
+#include <iomanip>
+
+bool writeChromeTrace(const char* path, const std::vector<TraceRing>& rings) {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+
+    out << std::fixed << std::setprecision(3);  // microseconds, to the nanosecond
+
+    size_t dropped = 0;
+    out << "{\"traceEvents\": [";
+    const char* separator = "\n";
+    for (size_t tid = 0; tid < rings.size(); ++tid) {
+        out << separator << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << tid
+            << ", \"args\": {\"name\": \"worker " << tid << "\"}}";
+        separator = ",\n";
+
+        rings[tid].forEach([&out, tid](const TraceEvent& event) {
+            out << ",\n{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << tid
+                << ", \"ts\": " << event.start << ", \"dur\": " << event.duration;
+            if (event.items >= 0) {
+                out << ", \"args\": {\"items\": " << event.items << "}";
+            }
+            out << "}";
+        });
+        dropped += rings[tid].dropped();
+    }
+    out << "\n], \"displayTimeUnit\": \"ms\", \"otherData\": {\"droppedEvents\": " << dropped << "}}\n";
+
+    out.flush();
+    return static_cast<bool>(out);
+}
@@ -0,0 +1,59 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <cstddef>
+#include <vector>
+
+// One finished span of a worker's timeline, in microseconds since the job
+// started.
+struct TraceEvent {
+    const char* name; // a string literal
+    double start;
+    double duration;
+    long long items;  // pairs or groups the span covered, -1 for none
+};
+
+// The TraceEvents of one worker: every phase span, and the latest `capacity`
+// finer spans, capacity being a power of two. Only its worker records into
+// it and it is only read once the worker is done, so recording is a plain
+// store. Once full, new finer spans overwrite the oldest ones, while phase
+// spans, a handful per job, are always kept.
+class TraceRing {
+public:
+    explicit TraceRing(size_t capacity) : events(capacity), recorded(0) {}
+
+    void recordPhase(const char* name, double start, double end) {
+        phases.push_back(TraceEvent{name, start, end - start, -1});
+    }
+
+    void record(const char* name, double start, double end, long long items = -1) {
+        events[recorded & (events.size() - 1)] = TraceEvent{name, start, end - start, items};
+        recorded++;
+    }
+
+    // number of events that were overwritten
+    size_t dropped() const { return recorded > events.size() ? recorded - events.size() : 0; }
+
+    // Calls f on every phase span, then on every finer span still in the
+    // ring, oldest first.
+    template <class F>
+    void forEach(F f) const {
+        for (const TraceEvent& phase : phases) {
+            f(phase);
+        }
+        for (size_t i = dropped(); i < recorded; ++i) {
+            f(events[i & (events.size() - 1)]);
+        }
+    }
+
+private:
+    std::vector<TraceEvent> phases;
+    std::vector<TraceEvent> events;
+    size_t recorded;
+};
+
+// Writes one ring per worker to path in the Chrome trace-event format, which
+// chrome://tracing and Perfetto open. Returns false if the file could not be
+// written.
+bool writeChromeTrace(const char* path, const std::vector<TraceRing>& rings);
+
+#endif // TRACE_H
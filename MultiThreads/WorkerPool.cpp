@@ -0,0 +1,117 @@
+#include "WorkerPool.h"
+#include "SystemError.h"
+
+#include <algorithm>
+#include <cmath>
+#include <system_error>
+#include <thread>
+
+WorkerPool& WorkerPool::instance() {
+    // Never destroyed: parked workers simply die with the process.
+    static WorkerPool* pool = new WorkerPool();
+    return *pool;
+}
+
+WorkerPool::WorkerPool()
+        : budget(0),
+          busy(0),
+          active_weight(0) {}
+
+void WorkerPool::setBudget(int workers) {
+    std::lock_guard<std::mutex> lock(mutex);
+    budget = std::max(workers, 0);
+    dispatchQueued();
+}
+
+double WorkerPool::checkedWeight(double weight) {
+    return std::isfinite(weight) && weight > 0 ? weight : 1.0;
+}
+
+int WorkerPool::share(int requested, double weight) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (budget == 0) {
+        return requested;
+    }
+    weight = checkedWeight(weight);
+    int fair = static_cast<int>(budget * weight / (active_weight + weight));
+    return std::max(1, std::min({requested, budget, fair}));
+}
+
+void WorkerPool::runGang(std::vector<std::function<void()>>& tasks, double weight) {
+    auto* gang = new Gang();
+    gang->tasks = std::move(tasks);
+    gang->weight = checkedWeight(weight);
+    gang->remaining = static_cast<int>(gang->tasks.size());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    active_weight += gang->weight;
+    if (queued.empty() && fits(*gang)) {
+        dispatch(gang);
+    } else {
+        queued.push_back(gang);
+    }
+}
+
+bool WorkerPool::fits(const Gang& gang) const {
+    return budget == 0 || busy == 0 || busy + static_cast<int>(gang.tasks.size()) <= budget;
+}
+
+void WorkerPool::dispatch(Gang* gang) {
+    busy += static_cast<int>(gang->tasks.size());
+    for (auto& task : gang->tasks) {
+        if (!idle.empty()) {
+            Worker* worker = idle.back();
+            idle.pop_back();
+            worker->task = std::move(task);
+            worker->gang = gang;
+            worker->cv.notify_one();
+            continue;
+        }
+
+        auto* worker = new Worker();
+        worker->task = std::move(task);
+        worker->gang = gang;
+        try {
+            std::thread(&WorkerPool::workerLoop, this, worker).detach();
+        } catch (...) {
+            delete worker;
+            throw;
+        }
+    }
+}
+
+// Runs on whichever thread freed up workers, so a failure to create a thread
+// cannot be thrown back to the job that queued the gang.
+void WorkerPool::dispatchQueued() {
+    while (!queued.empty() && fits(*queued.front())) {
+        Gang* gang = queued.front();
+        queued.pop_front();
+        try {
+            dispatch(gang);
+        } catch (const std::system_error& e) {
+            systemError("failed to create thread");
+        }
+    }
+}
+
+void WorkerPool::workerLoop(Worker* worker) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        std::function<void()> task = std::move(worker->task);
+        worker->task = nullptr;
+        lock.unlock();
+        task();
+        task = nullptr;
+        lock.lock();
+
+        busy--;
+        Gang* gang = worker->gang;
+        if (--gang->remaining == 0) {
+            active_weight -= gang->weight;
+            delete gang;
+        }
+        idle.push_back(worker);
+        dispatchQueued();
+        worker->cv.wait(lock, [worker] { return static_cast<bool>(worker->task); });
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Process-wide pool of worker threads shared by all MapReduce jobs.
+// Workers are created on demand and park once their task returns, so
+// back-to-back jobs reuse threads instead of creating new ones.
+//
+// With a budget, at most budget workers run tasks at once, whatever the
+// number of jobs, so concurrent jobs queue for workers instead of
+// oversubscribing the cores. A task must then not wait for a gang submitted
+// after its own, as that gang may be queued behind it.
+class WorkerPool {
+public:
+    static WorkerPool& instance();
+
+    // Caps the workers running tasks at once; 0 lifts the cap, which is the
+    // default. Gangs already running are not affected.
+    void setBudget(int workers);
+
+    // How many workers a new gang of the given weight should have: its
+    // weighted share of the budget next to the gangs already submitted and
+    // not yet done, at most requested and at least 1. Weights that are not
+    // positive and finite count as 1.0, here and in runGang.
+    int share(int requested, double weight);
+
+    // Runs every task on its own worker, all of them at the same time, and
+    // creates workers when not enough are idle. The tasks may therefore wait
+    // for each other, e.g. on a Barrier. When the budget has no room for the
+    // whole gang, it is queued behind the gangs submitted before it until
+    // enough of their workers are done; a gang larger than the budget runs
+    // once nothing else does.
+    // Throws std::system_error if a thread cannot be created.
+    void runGang(std::vector<std::function<void()>>& tasks, double weight = 1.0);
+
+private:
+    struct Gang {
+        std::vector<std::function<void()>> tasks;
+        double weight;
+        int remaining; // tasks not yet returned
+    };
+
+    struct Worker {
+        std::function<void()> task;
+        Gang* gang;
+        std::condition_variable cv;
+    };
+
+    WorkerPool();
+    void workerLoop(Worker* worker);
+    static double checkedWeight(double weight);
+
+    // Both expect mutex to be held.
+    bool fits(const Gang& gang) const;
+    void dispatch(Gang* gang);
+    void dispatchQueued();
+
+    std::mutex mutex;
+    std::vector<Worker*> idle;
+    std::deque<Gang*> queued;
+    int budget;
+    int busy;             // workers running a task
+    double active_weight; // of the queued and running gangs
+};
+
+#endif // WORKERPOOL_H
@@ -0,0 +1,1138 @@
+/**
+ * @brief MapReduceFramework benchmarks.
+ *
+ * usage: Benchmark <scenario> [max threads]
+ *
+ * workloads, each printing throughput, speedup over one thread and the
+ * slowest worker's time in every phase (from getJobStats):
+ *   wordcount        counts the words of Zipf-distributed text.
+ *   inverted-index   lists the documents every word of that text occurs in.
+ *   zipf             counts integer keys drawn from a Zipf distribution, so a
+ *                    few groups are huge; once more under HASH_SHUFFLE with a
+ *                    combiner and the reducer declared associative, so those
+ *                    groups are split.
+ *   high-cardinality counts integer keys that are almost all distinct.
+ *   suite            all four workloads above.
+ *
+ * scenarios:
+ *   reduce-scaling   cheap reduce that emits every value it gets, so the
+ *                    reduce phase is dominated by emit3.
+ *   typed-keys       the same counting job with int and string keys, through
+ *                    the pointer API and through MapReduceJob.
+ *   arena            a pointer API counting job whose K2/V2 come from new and
+ *                    delete, and from contextArena.
+ *   spill            a job with many distinct intermediate keys, with and
+ *                    without a memoryBudget, reporting the process' peak RSS.
+ *   barrier          the latency distribution of a single Barrier::barrier
+ *                    call, for both barrier modes and 2 to 64 threads.
+ *   batch            the map phase of a pointer API job emitting 16 pairs per
+ *                    input, through emit2, through emit2Batch, and through
+ *                    emit2Batch with the JobOptions capacity hints.
+ *   prefix           the pointer API counting job with int and string keys,
+ *                    with and without K2::normalizedPrefix.
+ *   radix            typed int keys sorted by the radix sort and by std::sort,
+ *                    with many and with few distinct keys.
+ *   merge            the shuffle's k-way merge of the threads' sorted runs,
+ *                    for 8 to 128 threads.
+ *   chain            a pipeline of 4 rounds that each merge keys 4 to 1, one
+ *                    round after the other through vectors, and all rounds
+ *                    at once through JobPipes.
+ *   lines            counts the words per line of a generated text file, read
+ *                    through a MappedLineReader and loaded into an InputVec,
+ *                    reporting the process' peak RSS.
+ *   sink             a counting job with as many outputs as inputs, writing
+ *                    them to a CallbackSink, a FileSink, a VectorSink and an
+ *                    OutputVec, reporting when the first result arrived and
+ *                    the process' peak RSS.
+ *   concurrent       4 to 32 counting jobs of max threads each started at
+ *                    once, without a worker budget and with a budget of the
+ *                    hardware concurrency.
+ *
+ * Every other scenario sweeps multiThreadLevel from 1 to max threads
+ * (default: the hardware concurrency) and prints one CSV row per thread count.
+ */
+
+#include "Barrier.h"
+#include "MapReduceClient.h"
+#include "MapReduceFramework.h"
+#include "MapReduceJob.h"
+#include "MappedLineReader.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <random>
+#include <sys/resource.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Every heap allocation in the process is counted, framework included. The
+// replacements are never inlined: GCC would otherwise see free() called on
+// the result of operator new and warn about a mismatched deallocation.
+static std::atomic<unsigned long long> heap_allocations(0);
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static double millisSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+class Num : public K1, public K2, public K3, public V1, public V2, public V3 {
+public:
+    explicit Num(int n) : num(n) {}
+    bool operator<(const K1 &other) const override { return num < static_cast<const Num&>(other).num; }
+    bool operator<(const K2 &other) const override { return num < static_cast<const Num&>(other).num; }
+    bool operator<(const K3 &other) const override { return num < static_cast<const Num&>(other).num; }
+    int num;
+};
+
+// Keys and values are preallocated, so the clients below measure the
+// framework rather than the allocator.
+class NumPool {
+public:
+    explicit NumPool(int size) {
+        for (int i = 0; i < size; ++i) {
+            nums.push_back(new Num(i));
+        }
+    }
+    ~NumPool() {
+        for (Num* n : nums) {
+            delete n;
+        }
+    }
+    Num* get(int i) const { return nums[i]; }
+
+private:
+    std::vector<Num*> nums;
+};
+
+struct JobTiming {
+    double total_ms;
+    double reduce_ms;
+};
+
+// Runs one job to completion, polling its state to find where the reduce
+// phase starts.
+static JobTiming timeJob(const MapReduceClient& client, const InputVec& input,
+                         OutputVec& output, int threads) {
+    Clock::time_point start = Clock::now();
+    JobHandle job = startMapReduceJob(client, input, output, threads);
+
+    JobState state = {UNDEFINED_STAGE, 0};
+    while (state.stage != REDUCE_STAGE) {
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+        getJobState(job, &state);
+    }
+    Clock::time_point reduce_start = Clock::now();
+
+    closeJobHandle(job);
+    return {millisSince(start), millisSince(reduce_start)};
+}
+
+// ---------- reduce-scaling ----------
+
+class EmitAllClient : public MapReduceClient {
+public:
+    EmitAllClient(const NumPool& keys, int groups) : keys(keys), groups(groups) {}
+
+    void map(const K1* key, const V1*, void* context) const override {
+        int n = static_cast<const Num*>(key)->num;
+        emit2(keys.get(n % groups), keys.get(n), context);
+    }
+
+    void reduce(const IntermediateVec* pairs, void* context) const override {
+        for (const IntermediatePair& pair : *pairs) {
+            emit3(static_cast<Num*>(pair.first), static_cast<Num*>(pair.second), context);
+        }
+    }
+
+private:
+    const NumPool& keys;
+    int groups;
+};
+
+static void reduceScaling(int max_threads) {
+    const int records = 2000000;
+    const int groups = 200000;
+    NumPool keys(std::max(records, groups));
+    InputVec input;
+    for (int i = 0; i < records; ++i) {
+        input.emplace_back(keys.get(i), keys.get(i));
+    }
+    EmitAllClient client(keys, groups);
+
+    std::printf("threads,total_ms,reduce_ms,reduce_speedup\n");
+    double base = 0;
+    for (int threads = 1; threads <= max_threads; ++threads) {
+        OutputVec output;
+        JobTiming t = timeJob(client, input, output, threads);
+        if (threads == 1) {
+            base = t.reduce_ms;
+        }
+        std::printf("%d,%.2f,%.2f,%.2f\n", threads, t.total_ms, t.reduce_ms, base / t.reduce_ms);
+    }
+}
+
+// ---------- typed-keys ----------
+
+class Str : public K2, public K3 {
+public:
+    explicit Str(std::string s) : str(std::move(s)) {}
+    bool operator<(const K2 &other) const override { return str < static_cast<const Str&>(other).str; }
+    bool operator<(const K3 &other) const override { return str < static_cast<const Str&>(other).str; }
+    std::string str;
+};
+
+static std::string keyName(int n) {
+    return "key-" + std::to_string(n);
+}
+
+class PrefixedNum : public Num {
+public:
+    explicit PrefixedNum(int n) : Num(n) {}
+    uint64_t normalizedPrefix() const override {
+        return static_cast<uint64_t>(static_cast<int64_t>(num)) ^ (uint64_t(1) << 63);
+    }
+};
+
+// The first 8 bytes of the string, big-endian, zero padded.
+class PrefixedStr : public Str {
+public:
+    explicit PrefixedStr(std::string s) : Str(std::move(s)) {}
+    uint64_t normalizedPrefix() const override {
+        uint64_t prefix = 0;
+        for (size_t i = 0; i < 8; ++i) {
+            prefix = (prefix << 8) | (i < str.size() ? static_cast<unsigned char>(str[i]) : 0);
+        }
+        return prefix;
+    }
+};
+
+// Counts input numbers modulo `keys`, allocating a key and a value per pair
+// the way pointer API clients do, either on the heap or from the arena. With
+// prefixed, the keys provide a normalizedPrefix.
+class PointerCountClient : public MapReduceClient {
+public:
+    PointerCountClient(int keys, bool strings, bool arena = false, bool prefixed = false)
+            : keys(keys), strings(strings), arena(arena), prefixed(prefixed) {}
+
+    void map(const K1* key, const V1*, void* context) const override {
+        int n = static_cast<const Num*>(key)->num % keys;
+        if (arena) {
+            Arena* a = contextArena(context);
+            K2* k = strings ? static_cast<K2*>(a->create<Str>(keyName(n))) : static_cast<K2*>(a->create<Num>(n));
+            emit2(k, a->create<Num>(1), context);
+            return;
+        }
+        K2* k;
+        if (prefixed) {
+            k = strings ? static_cast<K2*>(new PrefixedStr(keyName(n))) : static_cast<K2*>(new PrefixedNum(n));
+        } else {
+            k = strings ? static_cast<K2*>(new Str(keyName(n))) : static_cast<K2*>(new Num(n));
+        }
+        emit2(k, new Num(1), context);
+    }
+
+    bool hasNormalizedPrefix() const override { return prefixed; }
+
+    void reduce(const IntermediateVec* pairs, void* context) const override {
+        K2* key = pairs->front().first;
+        K3* k = strings ? static_cast<K3*>(new Str(static_cast<Str*>(key)->str))
+                        : static_cast<K3*>(new Num(static_cast<Num*>(key)->num));
+        emit3(k, new Num(static_cast<int>(pairs->size())), context);
+        if (arena) {
+            return;
+        }
+        for (const IntermediatePair& pair : *pairs) {
+            delete pair.first;
+            delete pair.second;
+        }
+    }
+
+private:
+    int keys;
+    bool strings;
+    bool arena;
+    bool prefixed;
+};
+
+template <class Key>
+struct TypedCount {
+    typedef MapReduceJob<int, int, Key, int, Key, int> Job;
+
+    class Client : public Job::Client {
+    public:
+        Client(int keys, Key (*makeKey)(int)) : keys(keys), makeKey(makeKey) {}
+
+        void map(const int& key, const int&, typename Job::Context& context) const override {
+            context.emit2(makeKey(key % keys), 1);
+        }
+
+        void reduce(const typename Job::IntermediateVec& pairs, typename Job::Context& context) const override {
+            context.emit3(pairs.front().first, static_cast<int>(pairs.size()));
+        }
+
+    private:
+        int keys;
+        Key (*makeKey)(int);
+    };
+
+    static double run(int records, int keys, Key (*makeKey)(int), int threads) {
+        typename Job::InputVec input;
+        for (int i = 0; i < records; ++i) {
+            input.emplace_back(static_cast<int>(i * 7919LL % records), 0);
+        }
+        typename Job::OutputVec output;
+        Client client(keys, makeKey);
+
+        Clock::time_point start = Clock::now();
+        closeJobHandle(Job::start(client, input, output, threads));
+        return millisSince(start);
+    }
+};
+
+static int intKey(int n) {
+    return n;
+}
+
+// Returns the job's wall time, and the number of heap allocations it made
+// through `allocations` when that is given.
+static double runPointerCount(int records, int keys, bool strings, int threads, bool arena = false,
+                              unsigned long long* allocations = nullptr, bool prefixed = false) {
+    NumPool nums(records);
+    InputVec input;
+    for (int i = 0; i < records; ++i) {
+        input.emplace_back(nums.get(static_cast<int>(i * 7919LL % records)), nullptr);
+    }
+    OutputVec output;
+    PointerCountClient client(keys, strings, arena, prefixed);
+
+    unsigned long long allocations_before = heap_allocations.load();
+    Clock::time_point start = Clock::now();
+    closeJobHandle(startMapReduceJob(client, input, output, threads));
+    double ms = millisSince(start);
+    if (allocations != nullptr) {
+        *allocations = heap_allocations.load() - allocations_before;
+    }
+
+    for (OutputPair& pair : output) {
+        delete pair.first;
+        delete pair.second;
+    }
+    return ms;
+}
+
+static void typedKeys(int max_threads) {
+    const int records = 1000000;
+    const int keys = 100000;
+
+    std::printf("threads,pointer_int_ms,typed_int_ms,pointer_string_ms,typed_string_ms\n");
+    for (int threads = 1; threads <= max_threads; ++threads) {
+        std::printf("%d,%.2f,%.2f,%.2f,%.2f\n", threads,
+                    runPointerCount(records, keys, false, threads),
+                    TypedCount<int>::run(records, keys, intKey, threads),
+                    runPointerCount(records, keys, true, threads),
+                    TypedCount<std::string>::run(records, keys, keyName, threads));
+    }
+}
+
+// ---------- arena ----------
+
+static void arenaAllocation(int max_threads) {
+    const int records = 1000000;
+    const int keys = 100000;
+
+    std::printf("threads,keys,heap_ms,heap_allocations,arena_ms,arena_allocations\n");
+    for (int threads = 1; threads <= max_threads; ++threads) {
+        for (bool strings : {false, true}) {
+            unsigned long long heap;
+            unsigned long long arena;
+            double heap_ms = runPointerCount(records, keys, strings, threads, false, &heap);
+            double arena_ms = runPointerCount(records, keys, strings, threads, true, &arena);
+
+            std::printf("%d,%s,%.2f,%llu,%.2f,%llu\n", threads, strings ? "string" : "int",
+                        heap_ms, heap, arena_ms, arena);
+        }
+    }
+}
+
+// ---------- prefix ----------
+
+static void prefixComparison(int max_threads) {
+    const int records = 1000000;
+    const int keys = 100000;
+
+    std::printf("threads,int_ms,prefixed_int_ms,string_ms,prefixed_string_ms\n");
+    for (int threads = 1; threads <= max_threads; ++threads) {
+        std::printf("%d,%.2f,%.2f,%.2f,%.2f\n", threads,
+                    runPointerCount(records, keys, false, threads),
+                    runPointerCount(records, keys, false, threads, false, nullptr, true),
+                    runPointerCount(records, keys, true, threads),
+                    runPointerCount(records, keys, true, threads, false, nullptr, true));
+    }
+}
+
+// ---------- spill ----------
+
+// Every record emits `fanout` pairs over `keys` distinct keys, so the
+// intermediate pairs far outnumber the output.
+class FanoutClient : public MapReduceJob<int, int, long long, long long, long long, long long>::Client {
+public:
+    typedef MapReduceJob<int, int, long long, long long, long long, long long> Job;
+
+    FanoutClient(int fanout, int keys) : fanout(fanout), keys(keys) {}
+
+    void map(const int& key, const int&, Job::Context& context) const override {
+        for (int i = 0; i < fanout; ++i) {
+            context.emit2((static_cast<long long>(key) * fanout + i) % keys, key);
+        }
+    }
+
+    void reduce(const Job::IntermediateVec& pairs, Job::Context& context) const override {
+        long long sum = 0;
+        for (const Job::IntermediatePair& pair : pairs) {
+            sum += pair.second;
+        }
+        context.emit3(pairs.front().first, sum);
+    }
+
+    bool canSpill() const override { return true; }
+
+    void serialize(const Job::IntermediatePair& pair, std::string& out) const override {
+        out.append(reinterpret_cast<const char*>(&pair.first), sizeof(pair.first));
+        out.append(reinterpret_cast<const char*>(&pair.second), sizeof(pair.second));
+    }
+
+    Job::IntermediatePair deserialize(const char* data, size_t) const override {
+        Job::IntermediatePair pair;
+        std::memcpy(&pair.first, data, sizeof(pair.first));
+        std::memcpy(&pair.second, data + sizeof(pair.first), sizeof(pair.second));
+        return pair;
+    }
+
+private:
+    int fanout;
+    int keys;
+};
+
+static long peakRssKb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Peak RSS only ever grows, so the budgeted runs go first and every row
+// reports the peak so far.
+static void spill(int max_threads) {
+    const int records = 2000000;
+    const int fanout = 8;
+    const size_t budget = 64u << 20;
+
+    FanoutClient::Job::InputVec input;
+    for (int i = 0; i < records; ++i) {
+        input.emplace_back(static_cast<int>(i * 7919LL % records), 0);
+    }
+    FanoutClient client(fanout, records / 4);
+
+    std::printf("threads,memory_budget_mb,ms,peak_rss_mb\n");
+    for (size_t job_budget : {budget, static_cast<size_t>(0)}) {
+        for (int threads = 1; threads <= max_threads; ++threads) {
+            JobOptions options;
+            options.memoryBudget = job_budget;
+            FanoutClient::Job::OutputVec output;
+
+            Clock::time_point start = Clock::now();
+            closeJobHandle(FanoutClient::Job::start(client, input, output, threads, options));
+            double ms = millisSince(start);
+
+            std::printf("%d,%zu,%.2f,%ld\n", threads, job_budget >> 20, ms, peakRssKb() / 1024);
+        }
+    }
+}
+
+// ---------- barrier ----------
+
+// Every thread times each of its barrier calls, from entering to leaving.
+// The fastest threads wait for the slowest ones, so the upper percentiles
+// include the time it takes the last thread to arrive.
+static std::vector<double> barrierLatencies(int threads, barrier_mode_t mode, int rounds) {
+    Barrier barrier(threads, mode);
+    std::vector<std::vector<double>> latencies(threads, std::vector<double>(rounds));
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&barrier, &latencies, t, rounds] {
+            for (int round = 0; round < rounds; ++round) {
+                Clock::time_point start = Clock::now();
+                barrier.barrier();
+                latencies[t][round] = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    std::vector<double> all;
+    for (const std::vector<double>& thread_latencies : latencies) {
+        all.insert(all.end(), thread_latencies.begin(), thread_latencies.end());
+    }
+    std::sort(all.begin(), all.end());
+    return all;
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+static void barrierLatency() {
+    const int rounds = 2000;
+
+    std::printf("threads,mode,p50_us,p90_us,p99_us,max_us\n");
+    for (int threads = 2; threads <= 64; threads *= 2) {
+        for (barrier_mode_t mode : {BLOCKING_BARRIER, SPINNING_BARRIER}) {
+            std::vector<double> latencies = barrierLatencies(threads, mode, rounds);
+            std::printf("%d,%s,%.2f,%.2f,%.2f,%.2f\n", threads,
+                        mode == SPINNING_BARRIER ? "spinning" : "blocking",
+                        percentile(latencies, 0.5), percentile(latencies, 0.9),
+                        percentile(latencies, 0.99), latencies.back());
+        }
+    }
+}
+
+// ---------- workloads ----------
+
+// Draws ranks 0..n-1 with probability proportional to 1 / (rank + 1)^s.
+class ZipfSampler {
+public:
+    ZipfSampler(int n, double s, unsigned seed) : cdf(n), random(seed) {
+        double sum = 0;
+        for (int rank = 0; rank < n; ++rank) {
+            sum += 1.0 / std::pow(rank + 1.0, s);
+            cdf[rank] = sum;
+        }
+        for (double& c : cdf) {
+            c /= sum;
+        }
+    }
+
+    int next() {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(random);
+        return static_cast<int>(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+    }
+
+private:
+    std::vector<double> cdf;
+    std::mt19937_64 random;
+};
+
+// Documents of words drawn from a Zipf-distributed vocabulary.
+static std::vector<std::pair<int, std::string>> makeDocuments(int documents, int words_per_document) {
+    ZipfSampler words(50000, 1.0, 1);
+    std::vector<std::pair<int, std::string>> input;
+    for (int doc = 0; doc < documents; ++doc) {
+        std::string text;
+        for (int i = 0; i < words_per_document; ++i) {
+            text += (i ? " w" : "w") + std::to_string(words.next());
+        }
+        input.emplace_back(doc, std::move(text));
+    }
+    return input;
+}
+
+template <class Emit>
+static void forEachWord(const std::string& text, Emit emit) {
+    size_t begin = 0;
+    while (begin < text.size()) {
+        size_t end = text.find(' ', begin);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        emit(text.substr(begin, end - begin));
+        begin = end + 1;
+    }
+}
+
+typedef MapReduceJob<int, std::string, std::string, int, std::string, int> WordCountJob;
+
+class WordCountClient : public WordCountJob::Client {
+public:
+    void map(const int&, const std::string& text, WordCountJob::Context& context) const override {
+        forEachWord(text, [&context](std::string word) { context.emit2(std::move(word), 1); });
+    }
+
+    void reduce(const WordCountJob::IntermediateVec& pairs, WordCountJob::Context& context) const override {
+        context.emit3(pairs.front().first, static_cast<int>(pairs.size()));
+    }
+};
+
+typedef MapReduceJob<int, std::string, std::string, int, std::string, std::vector<int>> InvertedIndexJob;
+
+class InvertedIndexClient : public InvertedIndexJob::Client {
+public:
+    void map(const int& doc, const std::string& text, InvertedIndexJob::Context& context) const override {
+        forEachWord(text, [&context, doc](std::string word) { context.emit2(std::move(word), doc); });
+    }
+
+    void reduce(const InvertedIndexJob::IntermediateVec& pairs, InvertedIndexJob::Context& context) const override {
+        std::vector<int> docs;
+        for (const InvertedIndexJob::IntermediatePair& pair : pairs) {
+            docs.push_back(pair.second);
+        }
+        std::sort(docs.begin(), docs.end());
+        docs.erase(std::unique(docs.begin(), docs.end()), docs.end());
+        context.emit3(pairs.front().first, std::move(docs));
+    }
+};
+
+typedef MapReduceJob<int, int, int, int, int, int> KeyCountJob;
+
+class KeyCountClient : public KeyCountJob::Client {
+public:
+    explicit KeyCountClient(bool associative = false) : associative(associative) {}
+
+    void map(const int& key, const int&, KeyCountJob::Context& context) const override {
+        context.emit2(key, 1);
+    }
+
+    void reduce(const KeyCountJob::IntermediateVec& pairs, KeyCountJob::Context& context) const override {
+        context.emit3(pairs.front().first, sum(pairs));
+    }
+
+    KeyCountJob::IntermediatePair combine(const KeyCountJob::IntermediateVec& pairs) const override {
+        return {pairs.front().first, sum(pairs)};
+    }
+
+    bool hasCombiner() const override { return associative; }
+    bool reduceIsAssociative() const override { return associative; }
+
+    bool hasKeyHash() const override { return true; }
+    size_t keyHash(const int& key) const override { return static_cast<size_t>(key); }
+
+private:
+    static int sum(const KeyCountJob::IntermediateVec& pairs) {
+        int count = 0;
+        for (const KeyCountJob::IntermediatePair& pair : pairs) {
+            count += pair.second;
+        }
+        return count;
+    }
+
+    bool associative;
+};
+
+static double slowest(const JobStats& stats, double (*phase)(const ThreadStats&)) {
+    double ms = 0;
+    for (const ThreadStats& thread : stats.threads) {
+        ms = std::max(ms, phase(thread) / 1000);
+    }
+    return ms;
+}
+
+static double mapTime(const ThreadStats& t) { return t.mapEnd - t.mapStart; }
+static double sortTime(const ThreadStats& t) { return t.sortEnd - t.mapEnd; }
+static double shuffleTime(const ThreadStats& t) { return t.shuffleEnd - t.shuffleStart; }
+static double reduceTime(const ThreadStats& t) { return t.reduceEnd - t.reduceStart; }
+
+static double barrierTime(const ThreadStats& t) {
+    double sum = 0;
+    for (double wait : t.barrierWaits) {
+        sum += wait;
+    }
+    return sum;
+}
+
+// Runs the job at every thread count and prints one row per run. items is
+// what throughput is counted in, e.g. words rather than documents.
+template <class Job>
+static void sweep(const char* name, const typename Job::Client& client,
+                  const typename Job::InputVec& input, long long items, int max_threads,
+                  const JobOptions& options = JobOptions()) {
+    double base = 0;
+    for (int threads = 1; threads <= max_threads; ++threads) {
+        typename Job::OutputVec output;
+        JobHandle job = Job::start(client, input, output, threads, options);
+        JobStats stats;
+        getJobStats(job, &stats);
+        closeJobHandle(job);
+
+        double ms = stats.totalTime / 1000;
+        if (threads == 1) {
+            base = ms;
+        }
+        std::printf("%s,%d,%lld,%.2f,%.0f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n", name, threads, items, ms,
+                    items / (ms / 1000), base / ms, slowest(stats, mapTime), slowest(stats, sortTime),
+                    slowest(stats, shuffleTime), slowest(stats, reduceTime), slowest(stats, barrierTime));
+    }
+}
+
+static void wordCount(int max_threads) {
+    const int documents = 20000;
+    const int words = 100;
+    WordCountJob::InputVec input = makeDocuments(documents, words);
+    sweep<WordCountJob>("wordcount", WordCountClient(), input, 1LL * documents * words, max_threads);
+}
+
+static void invertedIndex(int max_threads) {
+    const int documents = 20000;
+    const int words = 100;
+    InvertedIndexJob::InputVec input = makeDocuments(documents, words);
+    sweep<InvertedIndexJob>("inverted-index", InvertedIndexClient(), input, 1LL * documents * words, max_threads);
+}
+
+static void zipfKeys(int max_threads) {
+    const int records = 2000000;
+    ZipfSampler keys(100000, 1.1, 2);
+    KeyCountJob::InputVec input;
+    for (int i = 0; i < records; ++i) {
+        input.emplace_back(keys.next(), 0);
+    }
+    sweep<KeyCountJob>("zipf", KeyCountClient(), input, records, max_threads);
+
+    // A SORT_SHUFFLE combiner would collapse the huge groups map-side, so
+    // they are only split under HASH_SHUFFLE
+    JobOptions split;
+    split.shuffleMode = HASH_SHUFFLE;
+    sweep<KeyCountJob>("zipf-associative", KeyCountClient(true), input, records, max_threads, split);
+}
+
+static void highCardinality(int max_threads) {
+    const int records = 2000000;
+    std::mt19937 random(3);
+    KeyCountJob::InputVec input;
+    for (int i = 0; i < records; ++i) {
+        input.emplace_back(static_cast<int>(random() & 0x7fffffff), 0);
+    }
+    sweep<KeyCountJob>("high-cardinality", KeyCountClient(), input, records, max_threads);
+}
+
+static void printWorkloadHeader() {
+    std::printf("workload,threads,items,ms,items_per_s,speedup,map_ms,sort_ms,shuffle_ms,reduce_ms,barrier_ms\n");
+}
+
+// ---------- batch ----------
+
+// Emits `fanout` preallocated pairs per input, one by one or as one batch.
+class FanoutPointerClient : public MapReduceClient {
+public:
+    FanoutPointerClient(const NumPool& nums, int fanout, bool batch)
+            : nums(nums), fanout(fanout), batch(batch) {}
+
+    void map(const K1* key, const V1*, void* context) const override {
+        int n = static_cast<const Num*>(key)->num;
+        IntermediatePair pairs[64];
+        for (int i = 0; i < fanout; ++i) {
+            pairs[i] = IntermediatePair(nums.get((n + i * 7919) % 1000), nums.get(i));
+        }
+        if (batch) {
+            emit2Batch(pairs, fanout, context);
+            return;
+        }
+        for (int i = 0; i < fanout; ++i) {
+            emit2(pairs[i].first, pairs[i].second, context);
+        }
+    }
+
+    void reduce(const IntermediateVec* pairs, void* context) const override {
+        emit3(static_cast<Num*>(pairs->front().first), nums.get(static_cast<int>(pairs->size()) % 1000), context);
+    }
+
+private:
+    const NumPool& nums;
+    int fanout;
+    bool batch;
+};
+
+static void batchEmit(int max_threads) {
+    const int records = 500000;
+    const int fanout = 16;
+    NumPool nums(records);
+    InputVec input;
+    for (int i = 0; i < records; ++i) {
+        input.emplace_back(nums.get(i), nullptr);
+    }
+
+    std::printf("threads,emit2_map_ms,batch_map_ms,batch_hinted_map_ms\n");
+    for (int threads = 1; threads <= max_threads; ++threads) {
+        double ms[3];
+        for (int run = 0; run < 3; ++run) {
+            FanoutPointerClient client(nums, fanout, run > 0);
+            JobOptions options;
+            if (run == 2) {
+                options.expectedIntermediatePairs = static_cast<size_t>(records) * fanout;
+                options.expectedOutputPairs = 1000;
+            }
+            OutputVec output;
+            JobHandle job = startMapReduceJob(client, input, output, threads, options);
+            JobStats stats;
+            getJobStats(job, &stats);
+            closeJobHandle(job);
+            ms[run] = slowest(stats, mapTime);
+        }
+        std::printf("%d,%.2f,%.2f,%.2f\n", threads, ms[0], ms[1], ms[2]);
+    }
+}
+
+// ---------- radix ----------
+
+// Orders ints like std::less, but has no RadixKey, so jobs using it sort
+// with std::sort.
+struct ComparisonLess {
+    bool operator()(int a, int b) const { return a < b; }
+};
+
+typedef MapReduceJob<int, int, int, int, int, int, ComparisonLess> ComparisonCountJob;
+
+class ComparisonCountClient : public ComparisonCountJob::Client {
+public:
+    void map(const int& key, const int&, ComparisonCountJob::Context& context) const override {
+        context.emit2(key, 1);
+    }
+
+    void reduce(const ComparisonCountJob::IntermediateVec& pairs, ComparisonCountJob::Context& context) const override {
+        context.emit3(pairs.front().first, static_cast<int>(pairs.size()));
+    }
+};
+
+// Returns the slowest worker's sort time, and the job's time through total_ms.
+template <class Job>
+static double sortMillis(const typename Job::Client& client, const typename Job::InputVec& input,
+                         int threads, double& total_ms) {
+    typename Job::OutputVec output;
+    JobHandle job = Job::start(client, input, output, threads);
+    JobStats stats;
+    getJobStats(job, &stats);
+    closeJobHandle(job);
+    total_ms = stats.totalTime / 1000;
+    return slowest(stats, sortTime);
+}
+
+static void radixComparison(int max_threads) {
+    const int records = 4000000;
+
+    std::printf("threads,keys,radix_sort_ms,std_sort_ms,radix_total_ms,std_total_ms\n");
+    for (int keys : {1000, 1 << 30}) {
+        std::mt19937 random(6);
+        KeyCountJob::InputVec input;
+        for (int i = 0; i < records; ++i) {
+            input.emplace_back(static_cast<int>(random() % keys), 0);
+        }
+        for (int threads = 1; threads <= max_threads; ++threads) {
+            double radix_total;
+            double std_total;
+            double radix = sortMillis<KeyCountJob>(KeyCountClient(), input, threads, radix_total);
+            double std_sort = sortMillis<ComparisonCountJob>(ComparisonCountClient(), input, threads, std_total);
+            std::printf("%d,%d,%.2f,%.2f,%.2f,%.2f\n", threads, keys, radix, std_sort, radix_total, std_total);
+        }
+    }
+}
+
+// ---------- merge ----------
+
+// Every thread merges its key range out of all num_threads sorted runs, so the
+// shuffle's cost per pair grows with the thread count.
+static void mergeScaling() {
+    const int records = 2000000;
+    std::mt19937 random(4);
+    KeyCountJob::InputVec input;
+    for (int i = 0; i < records; ++i) {
+        input.emplace_back(static_cast<int>(random() & 0x7fffffff), 0);
+    }
+    KeyCountClient client;
+
+    std::printf("threads,ms,shuffle_ms\n");
+    for (int threads = 8; threads <= 128; threads *= 2) {
+        KeyCountJob::OutputVec output;
+        JobHandle job = KeyCountJob::start(client, input, output, threads);
+        JobStats stats;
+        getJobStats(job, &stats);
+        closeJobHandle(job);
+
+        std::printf("%d,%.2f,%.2f\n", threads, stats.totalTime / 1000, slowest(stats, shuffleTime));
+    }
+}
+
+// ---------- chain ----------
+
+// Merges every 4 consecutive keys into one, summing their values.
+class MergeKeysClient : public KeyCountJob::Client {
+public:
+    void map(const int& key, const int& value, KeyCountJob::Context& context) const override {
+        context.emit2(key >> 2, value);
+    }
+
+    void reduce(const KeyCountJob::IntermediateVec& pairs, KeyCountJob::Context& context) const override {
+        int sum = 0;
+        for (const KeyCountJob::IntermediatePair& pair : pairs) {
+            sum += pair.second;
+        }
+        context.emit3(pairs.front().first, sum);
+    }
+};
+
+static void chain(int max_threads) {
+    const int records = 4000000;
+    const int rounds = 4;
+    KeyCountJob::InputVec input;
+    for (int i = 0; i < records; ++i) {
+        input.emplace_back(i, 1);
+    }
+    MergeKeysClient client;
+
+    std::printf("threads,rounds,vectors_ms,pipes_ms\n");
+    for (int threads = 1; threads <= max_threads; ++threads) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<KeyCountJob::OutputVec> outputs(rounds);
+        for (int round = 0; round < rounds; ++round) {
+            closeJobHandle(KeyCountJob::start(client, round == 0 ? input : outputs[round - 1], outputs[round], threads));
+        }
+        double vectors = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        std::vector<JobPipe<KeyCountJob::OutputPair>> pipes(rounds - 1);
+        KeyCountJob::OutputVec output;
+        std::vector<JobHandle> jobs;
+        jobs.push_back(KeyCountJob::start(client, input, pipes[0], threads));
+        for (int round = 1; round < rounds - 1; ++round) {
+            jobs.push_back(KeyCountJob::start(client, pipes[round - 1], pipes[round], threads));
+        }
+        jobs.push_back(KeyCountJob::start(client, pipes[rounds - 2], output, threads));
+        for (JobHandle job : jobs) {
+            closeJobHandle(job);
+        }
+        double piped = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        std::printf("%d,%d,%.2f,%.2f\n", threads, rounds, vectors, piped);
+    }
+}
+
+// ---------- lines ----------
+
+typedef MapReduceJob<uint64_t, std::string, int, int, int, int> LineLengthJob;
+
+// Counts the lines with every number of words.
+class LineLengthClient : public LineLengthJob::Client {
+public:
+    void map(const uint64_t&, const std::string& line, LineLengthJob::Context& context) const override {
+        context.emit2(static_cast<int>(std::count(line.begin(), line.end(), ' ')) + 1, 1);
+    }
+
+    void reduce(const LineLengthJob::IntermediateVec& pairs, LineLengthJob::Context& context) const override {
+        context.emit3(pairs.front().first, static_cast<int>(pairs.size()));
+    }
+};
+
+// Peak RSS only ever grows, so the reader goes first and the file is written
+// without holding it in memory.
+static void lines(int max_threads) {
+    const int line_count = 2000000;
+    const char* directory = std::getenv("TMPDIR");
+    std::string path = std::string(directory ? directory : "/tmp") + "/mapreduce-lines.txt";
+    {
+        ZipfSampler words(50000, 1.0, 2);
+        std::ofstream file(path);
+        for (int line = 0; line < line_count; ++line) {
+            for (int i = 0, count = 1 + line % 16; i < count; ++i) {
+                file << (i ? " w" : "w") << words.next();
+            }
+            file << '\n';
+        }
+    }
+    LineLengthClient client;
+
+    std::printf("threads,input,ms,peak_rss_mb\n");
+    for (int threads = 1; threads <= max_threads; ++threads) {
+        Clock::time_point start = Clock::now();
+        MappedLineReader reader(path.c_str());
+        LineLengthJob::OutputVec output;
+        closeJobHandle(LineLengthJob::start(client, reader, output, threads));
+        std::printf("%d,reader,%.2f,%ld\n", threads, millisSince(start), peakRssKb() / 1024);
+    }
+
+    Clock::time_point start = Clock::now();
+    LineLengthJob::InputVec input;
+    std::ifstream file(path);
+    std::string line;
+    for (uint64_t offset = 0; std::getline(file, line); offset += line.size() + 1) {
+        input.emplace_back(offset, line);
+    }
+    LineLengthJob::OutputVec output;
+    closeJobHandle(LineLengthJob::start(client, input, output, max_threads));
+    std::printf("%d,vector,%.2f,%ld\n", max_threads, millisSince(start), peakRssKb() / 1024);
+    std::remove(path.c_str());
+}
+
+// ---------- sink ----------
+
+// Peak RSS only ever grows, so the sinks keeping the least go first.
+static void sinks(int max_threads) {
+    const int records = 4000000;
+    KeyCountJob::InputVec input;
+    for (int i = 0; i < records; ++i) {
+        input.emplace_back(static_cast<int>(i * 7919LL % records), 0);
+    }
+    KeyCountClient client;
+    const char* directory = std::getenv("TMPDIR");
+    std::string path = std::string(directory ? directory : "/tmp") + "/mapreduce-sink.txt";
+
+    std::printf("output,threads,ms,first_result_ms,peak_rss_mb\n");
+    for (int threads = 1; threads <= max_threads; ++threads) {
+        Clock::time_point start = Clock::now();
+        std::atomic<long long> first_result(-1);
+        CallbackSink<KeyCountJob::OutputPair> callback([&first_result, start](KeyCountJob::OutputPair&&) {
+            if (first_result.load(std::memory_order_relaxed) < 0) {
+                long long micros = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+                long long unset = -1;
+                first_result.compare_exchange_strong(unset, micros);
+            }
+        });
+        closeJobHandle(KeyCountJob::start(client, input, callback, threads));
+        std::printf("callback,%d,%.2f,%.2f,%ld\n", threads, millisSince(start), first_result / 1000.0, peakRssKb() / 1024);
+    }
+    for (int threads = 1; threads <= max_threads; ++threads) {
+        Clock::time_point start = Clock::now();
+        {
+            FileSink<KeyCountJob::OutputPair> file(path.c_str());
+            closeJobHandle(KeyCountJob::start(client, input, file, threads));
+        }
+        std::printf("file,%d,%.2f,,%ld\n", threads, millisSince(start), peakRssKb() / 1024);
+    }
+    std::remove(path.c_str());
+    for (int threads = 1; threads <= max_threads; ++threads) {
+        Clock::time_point start = Clock::now();
+        VectorSink<KeyCountJob::OutputPair> sink;
+        closeJobHandle(KeyCountJob::start(client, input, sink, threads));
+        std::printf("vector-sink,%d,%.2f,,%ld\n", threads, millisSince(start), peakRssKb() / 1024);
+    }
+    for (int threads = 1; threads <= max_threads; ++threads) {
+        Clock::time_point start = Clock::now();
+        KeyCountJob::OutputVec output;
+        closeJobHandle(KeyCountJob::start(client, input, output, threads));
+        std::printf("output-vec,%d,%.2f,,%ld\n", threads, millisSince(start), peakRssKb() / 1024);
+    }
+}
+
+// ---------- concurrent ----------
+
+// Starts `jobs` jobs at once and returns how long they took together.
+static double concurrentJobs(const KeyCountJob::InputVec& input, int jobs, int threads) {
+    KeyCountClient client;
+    std::vector<KeyCountJob::OutputVec> outputs(jobs);
+    std::vector<JobHandle> handles;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < jobs; ++i) {
+        handles.push_back(KeyCountJob::start(client, input, outputs[i], threads));
+    }
+    for (JobHandle job : handles) {
+        closeJobHandle(job);
+    }
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void concurrent(int max_threads) {
+    const int records = 500000;
+    std::mt19937 random(5);
+    KeyCountJob::InputVec input;
+    for (int i = 0; i < records; ++i) {
+        input.emplace_back(static_cast<int>(random() % 100000), 0);
+    }
+
+    int budget = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    std::printf("jobs,threads_per_job,budget,unbudgeted_ms,budgeted_ms\n");
+    for (int jobs = 4; jobs <= 32; jobs *= 2) {
+        setWorkerBudget(0);
+        double unbudgeted = concurrentJobs(input, jobs, max_threads);
+        setWorkerBudget(budget);
+        double budgeted = concurrentJobs(input, jobs, max_threads);
+        std::printf("%d,%d,%d,%.2f,%.2f\n", jobs, max_threads, budget, unbudgeted, budgeted);
+    }
+    setWorkerBudget(0);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s wordcount|inverted-index|zipf|high-cardinality|suite|"
+                             "reduce-scaling|typed-keys|arena|batch|prefix|radix|spill|barrier|merge|chain|lines|sink|concurrent [max threads]\n", argv[0]);
+        return 1;
+    }
+    int max_threads = argc > 2 ? std::atoi(argv[2])
+                               : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+
+    typedef void (*Workload)(int);
+    const std::pair<const char*, Workload> workloads[] = {
+        {"wordcount", wordCount},
+        {"inverted-index", invertedIndex},
+        {"zipf", zipfKeys},
+        {"high-cardinality", highCardinality},
+    };
+    bool suite = std::strcmp(argv[1], "suite") == 0;
+    bool ran = false;
+    for (const auto& workload : workloads) {
+        if (suite || std::strcmp(argv[1], workload.first) == 0) {
+            if (!ran) {
+                printWorkloadHeader();
+            }
+            workload.second(max_threads);
+            ran = true;
+        }
+    }
+    if (ran) {
+        return 0;
+    }
+
+    if (std::strcmp(argv[1], "reduce-scaling") == 0) {
+        reduceScaling(max_threads);
+    } else if (std::strcmp(argv[1], "typed-keys") == 0) {
+        typedKeys(max_threads);
+    } else if (std::strcmp(argv[1], "arena") == 0) {
+        arenaAllocation(max_threads);
+    } else if (std::strcmp(argv[1], "batch") == 0) {
+        batchEmit(max_threads);
+    } else if (std::strcmp(argv[1], "prefix") == 0) {
+        prefixComparison(max_threads);
+    } else if (std::strcmp(argv[1], "radix") == 0) {
+        radixComparison(max_threads);
+    } else if (std::strcmp(argv[1], "spill") == 0) {
+        spill(max_threads);
+    } else if (std::strcmp(argv[1], "barrier") == 0) {
+        barrierLatency();
+    } else if (std::strcmp(argv[1], "merge") == 0) {
+        mergeScaling();
+    } else if (std::strcmp(argv[1], "chain") == 0) {
+        chain(max_threads);
+    } else if (std::strcmp(argv[1], "lines") == 0) {
+        lines(max_threads);
+    } else if (std::strcmp(argv[1], "sink") == 0) {
+        sinks(max_threads);
+    } else if (std::strcmp(argv[1], "concurrent") == 0) {
+        concurrent(max_threads);
+    } else {
+        std::fprintf(stderr, "unknown scenario: %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,100 @@
+/**
+ * @brief run the same job with and without a memory budget - the spilled
+ * runs, read back through the streaming merge, must give the same output
+ */
+
+#include <iostream>
+#include "MapReduceClient.h"
+#include "MapReduceFramework.h"
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+unsigned int unique_keys = 5000;
+
+class elements : public K1, public K2, public K3, public V1, public V2, public V3 {
+public:
+    elements(int i) { num = i; }
+    bool operator<(const K1 &other) const { return num < dynamic_cast<const elements&>(other).num; }
+    bool operator<(const K2 &other) const { return num < dynamic_cast<const elements&>(other).num; }
+    bool operator<(const K3 &other) const { return num < dynamic_cast<const elements&>(other).num; }
+    int num;
+};
+
+template <class T>
+static int numOf(const T *p) { return static_cast<const elements*>(p)->num; }
+
+class tester : public MapReduceClient {
+public:
+    void map(const K1* key, const V1*, void* context) const override {
+        int input = numOf(key);
+        emit2(new elements(input % unique_keys), new elements(input % 7), context);
+    }
+    void reduce(const IntermediateVec* pairs, void* context) const override {
+        int sum = 0;
+        for (const auto &pair : *pairs) {
+            sum += numOf(pair.second);
+        }
+        emit3(new elements(numOf(pairs->at(0).first)), new elements(sum), context);
+        for (const auto &pair : *pairs) {
+            delete pair.first;
+            delete pair.second;
+        }
+    }
+
+    bool canSpill() const override { return true; }
+    void serialize(const IntermediatePair &pair, std::string &out) const override {
+        int nums[2] = { numOf(pair.first), numOf(pair.second) };
+        out.append(reinterpret_cast<const char*>(nums), sizeof(nums));
+    }
+    IntermediatePair deserialize(const char *data, size_t) const override {
+        int nums[2];
+        std::memcpy(nums, data, sizeof(nums));
+        return { new elements(nums[0]), new elements(nums[1]) };
+    }
+    void releasePair(const IntermediatePair &pair) const override {
+        delete pair.first;
+        delete pair.second;
+    }
+};
+
+static std::vector<std::pair<int, int>> run(const tester &client, const InputVec &input,
+                                            int threads, size_t memoryBudget) {
+    OutputVec output;
+    JobOptions options;
+    options.memoryBudget = memoryBudget;
+    closeJobHandle(startMapReduceJob(client, input, output, threads, options));
+
+    std::vector<std::pair<int, int>> result;
+    for (auto &p : output) {
+        result.emplace_back(numOf(p.first), numOf(p.second));
+        delete p.first;
+        delete p.second;
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+int main() {
+    tester client;
+    InputVec input;
+    std::srand(5);
+    for (int j = 0; j < 200000; ++j) {
+        input.push_back({ new elements(std::rand()), nullptr });
+    }
+
+    bool ok = true;
+    for (int threads : { 1, 2, 3, 4, 8 }) {
+        std::vector<std::pair<int, int>> expected = run(client, input, threads, 0);
+        // Small enough for every worker to spill dozens of runs
+        std::vector<std::pair<int, int>> spilled = run(client, input, threads, 64 * 1024);
+        bool same = expected.size() == unique_keys && spilled == expected;
+        std::cout << "threads " << threads << ":\t" << (same ? "ok" : "MISMATCH") << '\n';
+        ok = ok && same;
+    }
+
+    for (auto &p : input) { delete p.first; }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,109 @@
+/**
+ * @brief half of the pairs share one key - under HASH_SHUFFLE its group must
+ * be split across the workers, and the split group must still sum up right
+ */
+
+#include <iostream>
+#include "MapReduceClient.h"
+#include "MapReduceFramework.h"
+#include <algorithm>
+#include <map>
+#include <vector>
+
+unsigned int unique_keys = 1000;
+
+class elements : public K1, public K2, public K3, public V1, public V2, public V3 {
+public:
+    elements(int i) { num = i; }
+    bool operator<(const K1 &other) const { return num < dynamic_cast<const elements&>(other).num; }
+    bool operator<(const K2 &other) const { return num < dynamic_cast<const elements&>(other).num; }
+    bool operator<(const K3 &other) const { return num < dynamic_cast<const elements&>(other).num; }
+    int num;
+};
+
+template <class T>
+static int numOf(const T *p) { return static_cast<const elements*>(p)->num; }
+
+static int keyOf(int input) { return input % 2 ? 0 : 1 + input % unique_keys; }
+
+class tester : public MapReduceClient {
+public:
+    void map(const K1* key, const V1*, void* context) const override {
+        emit2(new elements(keyOf(numOf(key))), new elements(1), context);
+    }
+    void reduce(const IntermediateVec* pairs, void* context) const override {
+        emit3(new elements(numOf(pairs->at(0).first)), new elements(sum(pairs)), context);
+        for (const auto &pair : *pairs) {
+            delete pair.first;
+            delete pair.second;
+        }
+    }
+
+    bool hasCombiner() const override { return true; }
+    IntermediatePair combine(const IntermediateVec *pairs) const override {
+        static_cast<elements*>(pairs->front().second)->num = sum(pairs);
+        for (size_t i = 1; i < pairs->size(); ++i) {
+            delete pairs->at(i).first;
+            delete pairs->at(i).second;
+        }
+        return pairs->front();
+    }
+    bool reduceIsAssociative() const override { return true; }
+
+    bool hasKeyHash() const override { return true; }
+    size_t keyHash(const K2 *key) const override { return static_cast<size_t>(numOf(key)); }
+
+private:
+    static int sum(const IntermediateVec *pairs) {
+        int count = 0;
+        for (const auto &pair : *pairs) {
+            count += numOf(pair.second);
+        }
+        return count;
+    }
+};
+
+int main() {
+    tester client;
+    InputVec input;
+    std::map<int, int> expected;
+    std::srand(6);
+    for (int j = 0; j < 400000; ++j) {
+        int r = std::rand();
+        input.push_back({ new elements(r), nullptr });
+        expected[keyOf(r)]++;
+    }
+
+    bool ok = true;
+    for (int threads : { 1, 2, 4, 8 }) {
+        OutputVec output;
+        JobOptions options;
+        options.shuffleMode = HASH_SHUFFLE;
+        JobHandle job = startMapReduceJob(client, input, output, threads, options);
+        JobStats stats;
+        getJobStats(job, &stats);
+        closeJobHandle(job);
+
+        unsigned long long split = 0;
+        for (const ThreadStats &thread : stats.threads) {
+            split += thread.splitGroups;
+        }
+
+        size_t groups = output.size();
+        std::map<int, int> counts;
+        for (auto &p : output) {
+            counts[numOf(p.first)] += numOf(p.second);
+            delete p.first;
+            delete p.second;
+        }
+
+        // A single worker has no one to share a group with
+        bool same = groups == expected.size() && counts == expected && (threads == 1 ? split == 0 : split > 0);
+        std::cout << "threads " << threads << ":\tsplit groups " << split << '\t'
+                  << (same ? "ok" : "MISMATCH") << '\n';
+        ok = ok && same;
+    }
+
+    for (auto &p : input) { delete p.first; }
+    return ok ? 0 : 1;
+}
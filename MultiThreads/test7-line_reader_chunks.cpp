@@ -0,0 +1,131 @@
+/**
+ * @brief read a generated text file through PointerLineSource at several
+ * chunk sizes - every line must reach map exactly once, as it does when the
+ * file is loaded into an InputVec up front
+ */
+
+#include <iostream>
+#include "MapReduceClient.h"
+#include "MapReduceFramework.h"
+#include "MappedLineReader.h"
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+class elements : public K2, public K3, public V2, public V3 {
+public:
+    elements(long long i) { num = i; }
+    bool operator<(const K2 &other) const { return num < dynamic_cast<const elements&>(other).num; }
+    bool operator<(const K3 &other) const { return num < dynamic_cast<const elements&>(other).num; }
+    long long num;
+};
+
+template <class T>
+static long long numOf(const T *p) { return static_cast<const elements*>(p)->num; }
+
+// Every line becomes (offset, checksum of its text), so a line that is
+// dropped, duplicated or cut in the wrong place changes the output.
+class tester : public MapReduceClient {
+public:
+    void map(const K1* key, const V1* val, void* context) const override {
+        const std::string &text = static_cast<const LineText*>(val)->text;
+        long long checksum = static_cast<long long>(std::hash<std::string>()(text) % 1000003) * 1000 + text.size() % 1000;
+        emit2(new elements(static_cast<long long>(static_cast<const LineOffset*>(key)->offset)),
+              new elements(checksum), context);
+    }
+    void reduce(const IntermediateVec* pairs, void* context) const override {
+        long long sum = 0;
+        for (const auto &pair : *pairs) {
+            sum += numOf(pair.second);
+        }
+        emit3(new elements(numOf(pairs->at(0).first)), new elements(sum), context);
+        for (const auto &pair : *pairs) {
+            delete pair.first;
+            delete pair.second;
+        }
+    }
+};
+
+// Short lines, empty lines, lines of a few pages and "\r\n" endings.
+static std::string makeText(bool trailingNewline) {
+    std::srand(7);
+    std::string text;
+    for (int line = 0; line < 3000; ++line) {
+        int r = std::rand();
+        size_t length = r % 10 == 0 ? 0 : r % 50 == 1 ? 5000 + r % 3000 : r % 120;
+        for (size_t i = 0; i < length; ++i) {
+            text += static_cast<char>('a' + (r + i * 31) % 26);
+        }
+        text += r % 7 == 0 ? "\r\n" : "\n";
+    }
+    text += "last line";
+    if (trailingNewline) {
+        text += '\n';
+    }
+    return text;
+}
+
+// The lines of text as the reader should see them, without "\n" or "\r\n".
+static InputVec loadLines(const std::string &text) {
+    InputVec input;
+    size_t line = 0;
+    while (line < text.size()) {
+        size_t newline = text.find('\n', line);
+        size_t line_end = newline == std::string::npos ? text.size() : newline;
+        size_t text_end = line_end > line && text[line_end - 1] == '\r' ? line_end - 1 : line_end;
+        input.push_back({ new LineOffset(line), new LineText(text.substr(line, text_end - line)) });
+        line = line_end + 1;
+    }
+    return input;
+}
+
+static std::vector<std::pair<long long, long long>> collect(OutputVec &output) {
+    std::vector<std::pair<long long, long long>> result;
+    for (auto &p : output) {
+        result.emplace_back(numOf(p.first), numOf(p.second));
+        delete p.first;
+        delete p.second;
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+int main() {
+    tester client;
+    const char *tmp = std::getenv("TMPDIR");
+    bool ok = true;
+
+    for (bool trailingNewline : { true, false }) {
+        std::string text = makeText(trailingNewline);
+        std::string path = std::string(tmp ? tmp : "/tmp") + "/mapreduce-lines-XXXXXX";
+        int fd = mkstemp(&path[0]);
+        if (fd < 0 || write(fd, text.data(), text.size()) != static_cast<ssize_t>(text.size())) {
+            std::cout << "failed to write " << path << '\n';
+            return 1;
+        }
+        close(fd);
+
+        InputVec input = loadLines(text);
+        OutputVec loaded;
+        closeJobHandle(startMapReduceJob(client, input, loaded, 4));
+        std::vector<std::pair<long long, long long>> expected = collect(loaded);
+
+        for (size_t chunkBytes : { size_t(1), size_t(7), size_t(4096), size_t(1) << 20 }) {
+            PointerLineSource source(path.c_str(), chunkBytes);
+            OutputVec streamed;
+            closeJobHandle(startMapReduceJob(client, source, streamed, 4));
+            bool same = expected.size() == input.size() && collect(streamed) == expected;
+            std::cout << (trailingNewline ? "trailing newline" : "no trailing newline")
+                      << ", chunk " << chunkBytes << ":\t" << (same ? "ok" : "MISMATCH") << '\n';
+            ok = ok && same;
+        }
+
+        for (auto &p : input) { delete p.first; delete p.second; }
+        unlink(path.c_str());
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,75 @@
+/**
+ * @brief chain two typed jobs through a JobPipe - the second job maps the
+ * first one's chunks while they are still being written, and must end up with
+ * the same output as when the rounds are run one after the other on vectors
+ */
+
+#include <iostream>
+#include "MapReduceJob.h"
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+typedef MapReduceJob<int, int, int, int, int, int> CountJob;
+
+unsigned int unique_keys = 100000;
+
+// Round 1: how often every key occurs.
+class counter : public CountJob::Client {
+public:
+    void map(const int &key, const int &, CountJob::Context &context) const override {
+        context.emit2(key % unique_keys, 1);
+    }
+    void reduce(const CountJob::IntermediateVec &pairs, CountJob::Context &context) const override {
+        context.emit3(pairs.front().first, static_cast<int>(pairs.size()));
+    }
+};
+
+// Round 2: the sum of the keys that occur a given number of times.
+class histogram : public CountJob::Client {
+public:
+    void map(const int &key, const int &count, CountJob::Context &context) const override {
+        context.emit2(count, key);
+    }
+    void reduce(const CountJob::IntermediateVec &pairs, CountJob::Context &context) const override {
+        int sum = 0;
+        for (const auto &pair : pairs) {
+            sum = (sum + pair.second) % 1000003;
+        }
+        context.emit3(pairs.front().first, sum);
+    }
+};
+
+int main() {
+    counter first;
+    histogram second;
+    CountJob::InputVec input;
+    std::srand(8);
+    for (int j = 0; j < 1000000; ++j) {
+        input.emplace_back(std::rand(), 0);
+    }
+
+    bool ok = true;
+    for (int threads : { 1, 2, 3, 4, 8 }) {
+        CountJob::OutputVec counts;
+        CountJob::OutputVec expected;
+        closeJobHandle(CountJob::start(first, input, counts, threads));
+        closeJobHandle(CountJob::start(second, counts, expected, threads));
+
+        // Both are started before either is closed, so the second job reads
+        // the pipe while the first one still reduces
+        JobPipe<CountJob::OutputPair> pipe;
+        CountJob::OutputVec piped;
+        JobHandle writer = CountJob::start(first, input, pipe, threads);
+        JobHandle reader = CountJob::start(second, pipe, piped, threads);
+        closeJobHandle(writer);
+        closeJobHandle(reader);
+
+        std::sort(expected.begin(), expected.end());
+        std::sort(piped.begin(), piped.end());
+        bool same = !expected.empty() && piped == expected;
+        std::cout << "threads " << threads << ":\t" << (same ? "ok" : "MISMATCH") << '\n';
+        ok = ok && same;
+    }
+    return ok ? 0 : 1;
+}